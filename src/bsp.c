@@ -0,0 +1,335 @@
+#include "bsp.h"
+#include "array.h"
+#include "mesh.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Distance from a plane under which a vertex is considered on the plane
+#define BSP_PLANE_EPSILON 0.0001f
+// Number of triangles tried as splitter for every node
+#define BSP_SPLITTER_CANDIDATES 8
+
+static bsp_node_t *nodes = NULL;
+static bsp_triangle_t *node_triangles = NULL;
+static int *traversal_stack = NULL;
+static bool is_built = false;
+
+typedef struct {
+    int node;
+    bsp_triangle_t *triangles;
+} bsp_work_t;
+
+static vec3_t vec3_lerp(vec3_t a, vec3_t b, float t) {
+    vec3_t result = {a.x + t * (b.x - a.x), a.y + t * (b.y - a.y),
+                     a.z + t * (b.z - a.z)};
+    return result;
+}
+
+static text2_t text2_lerp(text2_t a, text2_t b, float t) {
+    text2_t result = {a.u + t * (b.u - a.u), a.v + t * (b.v - a.v)};
+    return result;
+}
+
+static float plane_distance(plane_t *plane, vec3_t point) {
+    return vec3_dot(vec3_sub(point, plane->point), plane->normal);
+}
+
+// Returns false for degenerate triangles which do not define a plane
+static bool plane_from_triangle(bsp_triangle_t *triangle, plane_t *plane) {
+    vec3_t ab = vec3_sub(triangle->vertices[1], triangle->vertices[0]);
+    vec3_t ac = vec3_sub(triangle->vertices[2], triangle->vertices[0]);
+    vec3_t normal = vec3_cross(ab, ac);
+    if (vec3_length(normal) < BSP_PLANE_EPSILON * BSP_PLANE_EPSILON) {
+        return false;
+    }
+    vec3_normalize(&normal);
+    plane->point = triangle->vertices[0];
+    plane->normal = normal;
+    return true;
+}
+
+// -1 back, 0 on the plane, 1 front
+static int classify_distance(float distance) {
+    if (distance > BSP_PLANE_EPSILON) {
+        return 1;
+    }
+    if (distance < -BSP_PLANE_EPSILON) {
+        return -1;
+    }
+    return 0;
+}
+
+// Returns -1 back, 0 coplanar, 1 front, 2 straddling the plane
+static int classify_triangle(plane_t *plane, bsp_triangle_t *triangle) {
+    bool has_front = false;
+    bool has_back = false;
+    for (int i = 0; i < 3; i++) {
+        int side = classify_distance(plane_distance(plane, triangle->vertices[i]));
+        has_front |= side > 0;
+        has_back |= side < 0;
+    }
+    if (has_front && has_back) {
+        return 2;
+    }
+    return has_front ? 1 : (has_back ? -1 : 0);
+}
+
+// Pick the candidate plane that splits the fewest triangles, ties broken by
+// how balanced the two halves are. Returns false only if every triangle is
+// degenerate.
+static bool choose_splitter(bsp_triangle_t *triangles, plane_t *splitter) {
+    int num_triangles = array_length(triangles);
+    int step = num_triangles / BSP_SPLITTER_CANDIDATES;
+    if (step < 1) {
+        step = 1;
+    }
+    bool found = false;
+    int best_score = 0;
+    for (int i = 0; i < num_triangles; i += step) {
+        plane_t plane;
+        if (!plane_from_triangle(&triangles[i], &plane)) {
+            continue;
+        }
+        int num_front = 0;
+        int num_back = 0;
+        int num_splits = 0;
+        for (int j = 0; j < num_triangles; j++) {
+            int side = classify_triangle(&plane, &triangles[j]);
+            num_front += side == 1;
+            num_back += side == -1;
+            num_splits += side == 2;
+        }
+        int score = num_splits * 8 + abs(num_front - num_back);
+        if (!found || score < best_score) {
+            found = true;
+            best_score = score;
+            *splitter = plane;
+        }
+    }
+    // Every sampled candidate was degenerate, any plane of the others still
+    // orders the triangles
+    for (int i = 0; i < num_triangles && !found; i++) {
+        found = plane_from_triangle(&triangles[i], splitter);
+    }
+    return found;
+}
+
+// Cut a triangle in two polygons along the plane and push the triangulated
+// pieces to the front and back lists, winding order is preserved so back-face
+// culling still works on the pieces
+static void split_triangle(plane_t *plane, bsp_triangle_t *triangle,
+                           bsp_triangle_t **front, bsp_triangle_t **back) {
+    vec3_t front_vertices[4];
+    text2_t front_texcoords[4];
+    int num_front = 0;
+    vec3_t back_vertices[4];
+    text2_t back_texcoords[4];
+    int num_back = 0;
+
+    float distances[3];
+    for (int i = 0; i < 3; i++) {
+        distances[i] = plane_distance(plane, triangle->vertices[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        int side_i = classify_distance(distances[i]);
+        int side_j = classify_distance(distances[j]);
+        if (side_i >= 0) {
+            front_vertices[num_front] = triangle->vertices[i];
+            front_texcoords[num_front] = triangle->texcoords[i];
+            num_front++;
+        }
+        if (side_i <= 0) {
+            back_vertices[num_back] = triangle->vertices[i];
+            back_texcoords[num_back] = triangle->texcoords[i];
+            num_back++;
+        }
+        if (side_i * side_j < 0) {
+            float t = distances[i] / (distances[i] - distances[j]);
+            vec3_t vertex =
+                vec3_lerp(triangle->vertices[i], triangle->vertices[j], t);
+            text2_t texcoord =
+                text2_lerp(triangle->texcoords[i], triangle->texcoords[j], t);
+            front_vertices[num_front] = vertex;
+            front_texcoords[num_front] = texcoord;
+            num_front++;
+            back_vertices[num_back] = vertex;
+            back_texcoords[num_back] = texcoord;
+            num_back++;
+        }
+    }
+
+    bsp_triangle_t piece = *triangle;
+    for (int i = 1; i < num_front - 1; i++) {
+        piece.vertices[0] = front_vertices[0];
+        piece.vertices[1] = front_vertices[i];
+        piece.vertices[2] = front_vertices[i + 1];
+        piece.texcoords[0] = front_texcoords[0];
+        piece.texcoords[1] = front_texcoords[i];
+        piece.texcoords[2] = front_texcoords[i + 1];
+        array_push(*front, piece);
+    }
+    for (int i = 1; i < num_back - 1; i++) {
+        piece.vertices[0] = back_vertices[0];
+        piece.vertices[1] = back_vertices[i];
+        piece.vertices[2] = back_vertices[i + 1];
+        piece.texcoords[0] = back_texcoords[0];
+        piece.texcoords[1] = back_texcoords[i];
+        piece.texcoords[2] = back_texcoords[i + 1];
+        array_push(*back, piece);
+    }
+}
+
+static int push_empty_node(void) {
+    bsp_node_t node = {.first_triangle = 0,
+                       .num_triangles = 0,
+                       .front = -1,
+                       .back = -1};
+    array_push(nodes, node);
+    return array_length(nodes) - 1;
+}
+
+// Collect the world space triangles of every mesh, meshes are expected to
+// keep their transform after the tree was built
+static bsp_triangle_t *collect_scene_triangles(void) {
+    bsp_triangle_t *triangles = NULL;
+    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+        mesh_t *mesh = get_mesh(mesh_index);
+        mat4_t world_matrix = get_mesh_world_matrix(mesh);
+        int num_faces = array_length(mesh->faces);
+        for (int i = 0; i < num_faces; i++) {
+            face_t *face = &mesh->faces[i];
+            int indices[3] = {face->a, face->b, face->c};
+            bsp_triangle_t triangle = {
+                .texcoords = {face->a_uv, face->b_uv, face->c_uv},
+                .color = face->color,
+                .mesh_index = mesh_index,
+                .face_index = i};
+            for (int j = 0; j < 3; j++) {
+                vec4_t vertex = mat4_mul_vec4(
+                    world_matrix, vec4_from_vec3(mesh->vertices[indices[j]]));
+                triangle.vertices[j] = vec3_from_vec4(vertex);
+            }
+            array_push(triangles, triangle);
+        }
+    }
+    return triangles;
+}
+
+void build_bsp_tree(void) {
+    free_bsp_tree();
+
+    bsp_triangle_t *scene_triangles = collect_scene_triangles();
+    if (scene_triangles == NULL) {
+        is_built = true;
+        return;
+    }
+
+    // Breadth first with an explicit queue, a convex mesh degenerates the
+    // tree into a list and recursion would go as deep as its face count
+    bsp_work_t *queue = NULL;
+    bsp_work_t root = {push_empty_node(), scene_triangles};
+    array_push(queue, root);
+    for (int q = 0; q < array_length(queue); q++) {
+        bsp_work_t work = queue[q];
+        int num_triangles = array_length(work.triangles);
+
+        plane_t splitter;
+        if (!choose_splitter(work.triangles, &splitter)) {
+            // Only degenerate triangles are left, nothing to order
+            nodes[work.node].first_triangle = array_length(node_triangles);
+            nodes[work.node].num_triangles = num_triangles;
+            for (int i = 0; i < num_triangles; i++) {
+                array_push(node_triangles, work.triangles[i]);
+            }
+            array_free(work.triangles);
+            continue;
+        }
+
+        bsp_triangle_t *front = NULL;
+        bsp_triangle_t *back = NULL;
+        nodes[work.node].plane = splitter;
+        nodes[work.node].first_triangle = array_length(node_triangles);
+        for (int i = 0; i < num_triangles; i++) {
+            bsp_triangle_t *triangle = &work.triangles[i];
+            switch (classify_triangle(&splitter, triangle)) {
+            case 0:
+                array_push(node_triangles, *triangle);
+                nodes[work.node].num_triangles++;
+                break;
+            case 1:
+                array_push(front, *triangle);
+                break;
+            case -1:
+                array_push(back, *triangle);
+                break;
+            default:
+                split_triangle(&splitter, triangle, &front, &back);
+                break;
+            }
+        }
+        array_free(work.triangles);
+
+        if (front != NULL) {
+            int child = push_empty_node();
+            nodes[work.node].front = child;
+            bsp_work_t child_work = {child, front};
+            array_push(queue, child_work);
+        }
+        if (back != NULL) {
+            int child = push_empty_node();
+            nodes[work.node].back = child;
+            bsp_work_t child_work = {child, back};
+            array_push(queue, child_work);
+        }
+    }
+    array_free(queue);
+
+    // Every node is pushed once to be visited and once to be emitted
+    traversal_stack = (int *)malloc(sizeof(int) * 2 * array_length(nodes));
+    is_built = true;
+}
+
+bool is_bsp_tree_built(void) { return is_built; }
+
+// Stack entries hold the node index shifted left by one, the low bit tells
+// whether to emit the node triangles or to visit its children
+void traverse_bsp_tree(vec3_t eye, bsp_emit_t emit) {
+    if (array_length(nodes) == 0) {
+        return;
+    }
+    int stack_size = 0;
+    traversal_stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        int entry = traversal_stack[--stack_size];
+        bsp_node_t *node = &nodes[entry >> 1];
+        if (entry & 1) {
+            for (int i = 0; i < node->num_triangles; i++) {
+                emit(&node_triangles[node->first_triangle + i]);
+            }
+            continue;
+        }
+        // Back to front draws the far side first, the stack is LIFO so the
+        // near side, drawn last, is pushed first
+        bool eye_in_front = plane_distance(&node->plane, eye) >= 0;
+        int near_child = eye_in_front ? node->front : node->back;
+        int far_child = eye_in_front ? node->back : node->front;
+        if (near_child >= 0) {
+            traversal_stack[stack_size++] = near_child << 1;
+        }
+        traversal_stack[stack_size++] = (entry | 1);
+        if (far_child >= 0) {
+            traversal_stack[stack_size++] = far_child << 1;
+        }
+    }
+}
+
+void free_bsp_tree(void) {
+    array_free(nodes);
+    array_free(node_triangles);
+    free(traversal_stack);
+    nodes = NULL;
+    node_triangles = NULL;
+    traversal_stack = NULL;
+    is_built = false;
+}
@@ -0,0 +1,38 @@
+#ifndef BSP_H
+#define BSP_H
+
+#include "clipping.h"
+#include "texture.h"
+#include "vector.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// World space triangle stored in the tree, triangles that straddle a splitting
+// plane are cut into pieces, so keep track of the face they came from
+typedef struct {
+    vec3_t vertices[3];
+    text2_t texcoords[3];
+    uint32_t color;
+    int mesh_index;
+    int face_index;
+} bsp_triangle_t;
+
+typedef struct {
+    plane_t plane;
+    // Triangles lying on the splitting plane
+    int first_triangle;
+    int num_triangles;
+    // Child node indices, -1 if empty
+    int front;
+    int back;
+} bsp_node_t;
+
+typedef void (*bsp_emit_t)(const bsp_triangle_t *triangle);
+
+void build_bsp_tree(void);
+bool is_bsp_tree_built(void);
+// Emits the triangles back to front as seen from eye
+void traverse_bsp_tree(vec3_t eye, bsp_emit_t emit);
+void free_bsp_tree(void);
+
+#endif
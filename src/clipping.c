@@ -141,3 +141,49 @@ void clip_polygon(polygon_t *polygon) {
     clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
     clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
 }
+
+// Clip the camera space segment a-b against the six frustum planes, returns
+// false if nothing of the segment is left
+bool clip_line(vec3_t *a, vec3_t *b) {
+    float t_start = 0.0f;
+    float t_end = 1.0f;
+    for (int i = 0; i < NUM_PLANES; i++) {
+        vec3_t plane_point = frustum_planes[i].point;
+        vec3_t plane_normal = frustum_planes[i].normal;
+        float dot_a = vec3_dot(vec3_sub(*a, plane_point), plane_normal);
+        float dot_b = vec3_dot(vec3_sub(*b, plane_point), plane_normal);
+        if (dot_a < 0 && dot_b < 0) {
+            return false;
+        }
+        if (dot_a < 0) {
+            float t = dot_a / (dot_a - dot_b);
+            t_start = t > t_start ? t : t_start;
+        } else if (dot_b < 0) {
+            float t = dot_a / (dot_a - dot_b);
+            t_end = t < t_end ? t : t_end;
+        }
+        if (t_start > t_end) {
+            return false;
+        }
+    }
+    vec3_t start = *a;
+    vec3_t end = *b;
+    *a = vec3_new(float_lerp(start.x, end.x, t_start),
+                  float_lerp(start.y, end.y, t_start),
+                  float_lerp(start.z, end.z, t_start));
+    *b = vec3_new(float_lerp(start.x, end.x, t_end),
+                  float_lerp(start.y, end.y, t_end),
+                  float_lerp(start.z, end.z, t_end));
+    return true;
+}
+
+bool is_point_inside_frustum(vec3_t point) {
+    for (int i = 0; i < NUM_PLANES; i++) {
+        vec3_t plane_point = frustum_planes[i].point;
+        vec3_t plane_normal = frustum_planes[i].normal;
+        if (vec3_dot(vec3_sub(point, plane_point), plane_normal) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -3,6 +3,7 @@
 
 #include "triangle.h"
 #include "vector.h"
+#include <stdbool.h>
 
 #define MAX_NUM_POLY_VERTICES 10
 #define MAX_NUM_POLY_TRIANGLES 10
@@ -33,5 +34,7 @@ polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2,
 void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
                             int *num_triangles);
 void clip_polygon(polygon_t *polygon);
+bool clip_line(vec3_t *a, vec3_t *b);
+bool is_point_inside_frustum(vec3_t point);
 
 #endif
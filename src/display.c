@@ -1,19 +1,301 @@
 #include "display.h"
+#include <math.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// The depth buffer is cleared lazily in segments of 64 pixels of a row, a
+// segment whose epoch is behind the frame epoch holds the depth of an old
+// frame and is reset the first time the frame touches it
+#define DEPTH_SEGMENT_SHIFT 6
+#define DEPTH_SEGMENT_SIZE (1 << DEPTH_SEGMENT_SHIFT)
+// Frames rendered by the main thread while the present thread uploads the
+// previous one
+#define NUM_COLOR_BUFFERS 2
+// Render target rows start on cache line boundaries, so SIMD stores of a row
+// never split a line, in pixels of the smallest format
+#define RENDER_TARGET_ALIGNMENT 64
+#define PIXELS_PER_ALIGNMENT (RENDER_TARGET_ALIGNMENT / sizeof(uint16_t))
+// Targets this big are aligned to and advised for transparent huge pages
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// With the tiled layout the targets are stored as 16x16 pixel tiles, a tile
+// row of 32-bit pixels is one cache line and the color and depth of a whole
+// tile fit in L1 while a triangle covers it
+#define TILE_SHIFT 4
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+// Pixels of a skipped interlaced row keep the previous frame while its depth
+// differs from one of the rows above and below by at most this fraction
+#define INTERLACE_DEPTH_TOLERANCE 0.02f
+
+// A finished frame in one of the color buffers, pitch is the size in bytes
+// of a row of pixels, for tiled frames a row of tiles spans TILE_SIZE rows
+typedef struct {
+    SDL_Rect rect;
+    int pitch;
+    int pixel_size;
+    bool is_tiled;
+} frame_t;
+
+// A backend owns the output surface, it decides the resolution, hands out the
+// buffer every frame is rendered into and presents the finished frame
+typedef struct {
+    bool (*initialize)(void);
+    void (*lock_frame)(void);
+    void (*present_frame)(void);
+    void (*resize)(void);
+    void (*destroy)(void);
+} display_backend_t;
 
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 
-static uint32_t *color_buffer = NULL;
-static float *z_buffer = NULL;
+// Points into the locked streaming texture while a frame is rendered with
+// zero-copy presentation, into the back buffer of color_buffers otherwise
+static void *color_buffer = NULL;
+static void *color_buffers[NUM_COLOR_BUFFERS] = {NULL};
+static int back_buffer = 0;
+// Frame held by every color buffer, upscaled on present
+static frame_t frames[NUM_COLOR_BUFFERS];
+// Distance between rows of color_buffer in pixels
+static int color_pitch = 0;
+// Padded row length of the buffers allocated here, color, background and
+// depth share it, and the number of rows they hold, padded to whole tiles
+// with the tiled layout
+static int buffer_pitch = 0;
+static int buffer_rows = 0;
+static bool tiled_layout = false;
+static bool zero_copy_present = true;
+static bool is_color_buffer_locked = false;
+
+// With async presentation the present thread owns the renderer and the
+// texture, the main thread hands finished frames over through pending_buffer.
+// SDL only supports its render API on the thread that created the window on
+// some platforms, and SDL_PollEvent updates the renderer on window events,
+// so it is opt-in.
+static bool async_present = false;
+static SDL_Thread *present_thread = NULL;
+static SDL_mutex *present_mutex = NULL;
+static SDL_cond *present_cond = NULL;
+static int pending_buffer = -1;
+static int uploading_buffer = -1;
+static int renderer_state = 0; // 0 not created yet, 1 created, -1 failed
+static bool should_stop_presenting = false;
+static bool should_resize_texture = false;
+// Static backdrop copied into the color buffer at the start of every frame
+static void *background_buffer = NULL;
+static void *z_buffer = NULL;
+static uint32_t *z_segment_epochs = NULL;
+static uint32_t z_epoch = 1;
+// Segments are 64 pixels of a row with the linear layout and whole tiles
+// with the tiled one
+static int z_segments_per_row = 0;
+static int z_num_segments = 0;
 
 static SDL_Texture *color_buffer_texture = NULL;
+// Size of the display the buffers are allocated for
+static int display_width = 800;
+static int display_height = 600;
+// Current internal render resolution, at most the display size
 static int window_width = 800;
 static int window_height = 600;
+static float render_scale = 1.0f;
+static uint32_t background_color = 0xFF000000;
+// Buffers are allocated for the widest formats, so switching formats only
+// changes how their memory is read
+static int color_format = COLOR_FORMAT_RGBA8888;
+static int depth_format = DEPTH_FORMAT_FLOAT;
+static float depth_near = 0.1f;
 
 static int render_method = 0;
 static int cull_method = 0;
+static bool depth_test = true;
+static int visibility_method = VISIBILITY_DEPTH_BUFFER;
+static bool variable_rate_shading = false;
+// Interlaced frames rasterize every other row, interlace_field is the parity
+// of the rows of the current frame, -1 if it renders all of them.
+// history_buffer holds the last presented frame, NULL if it is unusable.
+static bool interlaced = false;
+static int interlace_field = -1;
+static void *history_buffer = NULL;
+static scissor_t scissor = {0, 0, 800, 600};
 
-bool initialize_window(void) {
+// Offscreen backend settings
+static int offscreen_width = 800;
+static int offscreen_height = 600;
+static const char *dump_directory = NULL;
+static int num_presented_frames = 0;
+
+static int get_color_pixel_size(void) {
+    return color_format == COLOR_FORMAT_RGB565 ? sizeof(uint16_t)
+                                               : sizeof(uint32_t);
+}
+
+// Colors are packed once per primitive, store_pixel writes the packed value
+static uint32_t pack_color(uint32_t color) {
+    return color_format == COLOR_FORMAT_RGB565 ? pack_rgb565(color) : color;
+}
+
+static inline void store_pixel(uint8_t *pixel, uint32_t packed) {
+    if (color_format == COLOR_FORMAT_RGB565) {
+        *(uint16_t *)pixel = (uint16_t)packed;
+    } else {
+        *(uint32_t *)pixel = packed;
+    }
+}
+
+static void create_color_buffer_texture(void) {
+    // Windows OS uses little endian, bytes in uint32_t are reversed
+    // SDL_PIXELFORMAT_RGBA32 is SDL_PIXELFORMAT_ABGR8888
+    // For 0xFF112233, FF is Alpha, 11 is Blue, 22 is Green, 33 is Red
+    // An RGB565 frame is expanded by the renderer when it is presented
+    Uint32 format = color_format == COLOR_FORMAT_RGB565
+                        ? SDL_PIXELFORMAT_RGB565
+                        : SDL_PIXELFORMAT_RGBA32;
+    color_buffer_texture =
+        SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING,
+                          display_width, display_height);
+}
+
+static bool create_renderer(void) {
+    renderer = SDL_CreateRenderer(window, -1, 0);
+    if (!renderer) {
+        fprintf(stderr, "Error creating SDL renderer.\n");
+        return false;
+    }
+    create_color_buffer_texture();
+    return true;
+}
+
+static void *allocate_render_target(size_t size) {
+#if defined(_WIN32)
+    return _aligned_malloc(size, RENDER_TARGET_ALIGNMENT);
+#else
+    size_t alignment =
+        size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : RENDER_TARGET_ALIGNMENT;
+    void *memory = NULL;
+    if (posix_memalign(&memory, alignment, size) != 0) {
+        return NULL;
+    }
+#if defined(MADV_HUGEPAGE)
+    // Fewer TLB misses on buffers of tens of megabytes, only a hint, the
+    // kernel may still back them with small pages
+    if (alignment == HUGE_PAGE_SIZE) {
+        madvise(memory, size, MADV_HUGEPAGE);
+    }
+#endif
+    return memory;
+#endif
+}
+
+static void free_render_target(void *memory) {
+#if defined(_WIN32)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// Copy the rows of a frame to linear memory, tiled frames are linearized here
+// once instead of every writer converting coordinates
+static void copy_frame_rows(uint8_t *destination, int destination_pitch,
+                            const uint8_t *pixels, const frame_t *frame) {
+    size_t row_size = (size_t)frame->rect.w * frame->pixel_size;
+    if (!frame->is_tiled) {
+        for (int y = 0; y < frame->rect.h; y++) {
+            memcpy(destination + (size_t)destination_pitch * y,
+                   pixels + (size_t)frame->pitch * y, row_size);
+        }
+        return;
+    }
+    size_t run_size = (size_t)TILE_SIZE * frame->pixel_size;
+    size_t tile_size = run_size * TILE_SIZE;
+    int num_full_tiles = frame->rect.w >> TILE_SHIFT;
+    size_t last_run_size = row_size - num_full_tiles * run_size;
+    for (int y = 0; y < frame->rect.h; y++) {
+        const uint8_t *run = pixels + (size_t)frame->pitch * (y & ~TILE_MASK) +
+                             run_size * (y & TILE_MASK);
+        uint8_t *row = destination + (size_t)destination_pitch * y;
+        for (int tile = 0; tile < num_full_tiles; tile++) {
+            memcpy(row, run, run_size);
+            row += run_size;
+            run += tile_size;
+        }
+        if (last_run_size > 0) {
+            memcpy(row, run, last_run_size);
+        }
+    }
+}
+
+// Tiled frames are linearized straight into the locked texture
+static void upload_frame(const frame_t *frame, const void *pixels) {
+    SDL_Rect rect = frame->rect;
+    if (!frame->is_tiled) {
+        SDL_UpdateTexture(color_buffer_texture, &rect, pixels, frame->pitch);
+        return;
+    }
+    void *texels;
+    int pitch;
+    if (SDL_LockTexture(color_buffer_texture, &rect, &texels, &pitch) == 0) {
+        copy_frame_rows(texels, pitch, pixels, frame);
+        SDL_UnlockTexture(color_buffer_texture);
+    }
+}
+
+// Upload and present frame N while the main thread already renders frame N+1,
+// the renderer is created here since SDL renderers are bound to their thread
+static int present_frames(void *data) {
+    (void)data;
+    bool is_created = create_renderer();
+    SDL_LockMutex(present_mutex);
+    renderer_state = is_created ? 1 : -1;
+    SDL_CondBroadcast(present_cond);
+    while (is_created) {
+        while (pending_buffer < 0 && !should_stop_presenting) {
+            SDL_CondWait(present_cond, present_mutex);
+        }
+        if (pending_buffer < 0) {
+            break;
+        }
+        int buffer = pending_buffer;
+        uploading_buffer = buffer;
+        pending_buffer = -1;
+        if (should_resize_texture) {
+            // The display was resized, the main thread waits while the
+            // buffers are reallocated so nothing is queued here
+            SDL_DestroyTexture(color_buffer_texture);
+            create_color_buffer_texture();
+            should_resize_texture = false;
+        }
+        SDL_CondBroadcast(present_cond);
+        SDL_UnlockMutex(present_mutex);
+
+        SDL_Rect rect = frames[buffer].rect;
+        upload_frame(&frames[buffer], color_buffers[buffer]);
+
+        // The buffer is free for rendering again, presenting may block on
+        // vsync without holding it
+        SDL_LockMutex(present_mutex);
+        uploading_buffer = -1;
+        SDL_CondBroadcast(present_cond);
+        SDL_UnlockMutex(present_mutex);
+
+        SDL_RenderCopy(renderer, color_buffer_texture, &rect, NULL);
+        SDL_RenderPresent(renderer);
+        SDL_LockMutex(present_mutex);
+    }
+    SDL_UnlockMutex(present_mutex);
+    if (is_created) {
+        SDL_DestroyTexture(color_buffer_texture);
+        SDL_DestroyRenderer(renderer);
+    }
+    return 0;
+}
+
+static bool sdl_initialize(void) {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         fprintf(stderr, "Error initializing SDL.\n");
         return false;
@@ -24,9 +306,9 @@ bool initialize_window(void) {
     int fullscreen_width = display_mode.w;
     int fullscreen_height = display_mode.h;
 
-    // Simulating low resolution displays
-    window_width = fullscreen_width / 1;
-    window_height= fullscreen_height / 1;
+    // Lower internal resolutions are picked at run time by set_render_scale
+    display_width = fullscreen_width;
+    display_height = fullscreen_height;
 
     window = SDL_CreateWindow(NULL, SDL_WINDOWPOS_CENTERED,
                               SDL_WINDOWPOS_CENTERED, fullscreen_width,
@@ -35,119 +317,907 @@ bool initialize_window(void) {
         fprintf(stderr, "Error creating SDL window.\n");
         return false;
     }
-    renderer = SDL_CreateRenderer(window, -1, 0);
-    if (!renderer) {
-        fprintf(stderr, "Error creating SDL renderer.\n");
+    SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
+
+    // Presenting on another thread only pays off with a core to run it on
+    async_present = async_present && SDL_GetCPUCount() > 1;
+    if (!async_present) {
+        return create_renderer();
+    }
+    present_mutex = SDL_CreateMutex();
+    present_cond = SDL_CreateCond();
+    present_thread = SDL_CreateThread(present_frames, "present", NULL);
+    SDL_LockMutex(present_mutex);
+    while (renderer_state == 0) {
+        SDL_CondWait(present_cond, present_mutex);
+    }
+    SDL_UnlockMutex(present_mutex);
+    return renderer_state > 0;
+}
+
+// With zero-copy presentation the frame is rasterized straight into the
+// pixels of the streaming texture, saving the full frame copy of
+// SDL_UpdateTexture. Locked pixels are write-only and undefined on lock, which
+// is fine because every frame starts by restoring the whole background, but
+// such a frame cannot be read back by the next one.
+static void sdl_lock_frame(void) {
+    if (async_present) {
+        // The texture belongs to the present thread, so frames are always
+        // rendered into the color buffers. Wait until the back buffer of the
+        // previous round has been uploaded.
+        SDL_LockMutex(present_mutex);
+        while (pending_buffer == back_buffer ||
+               uploading_buffer == back_buffer) {
+            SDL_CondWait(present_cond, present_mutex);
+        }
+        SDL_UnlockMutex(present_mutex);
+        color_buffer = color_buffers[back_buffer];
+        color_pitch = buffer_pitch;
+        return;
+    }
+    // The texture is linear, tiled frames are rendered into the back buffer,
+    // and so are interlaced ones since they build on the previous frame
+    if (zero_copy_present && !tiled_layout && !interlaced) {
+        void *pixels;
+        int pitch;
+        SDL_Rect rect = {0, 0, window_width, window_height};
+        if (SDL_LockTexture(color_buffer_texture, &rect, &pixels, &pitch) ==
+            0) {
+            if (pitch % get_color_pixel_size() == 0) {
+                color_buffer = pixels;
+                color_pitch = pitch / get_color_pixel_size();
+                is_color_buffer_locked = true;
+                return;
+            }
+            // Rows not aligned to pixels, keep copying from now on
+            SDL_UnlockTexture(color_buffer_texture);
+        }
+        zero_copy_present = false;
+    }
+    color_buffer = color_buffers[back_buffer];
+    color_pitch = buffer_pitch;
+}
+
+static frame_t describe_frame(void) {
+    frame_t frame = {.rect = {0, 0, window_width, window_height},
+                     .pitch = color_pitch * get_color_pixel_size(),
+                     .pixel_size = get_color_pixel_size(),
+                     .is_tiled = tiled_layout};
+    return frame;
+}
+
+static void sdl_present_frame(void) {
+    if (async_present) {
+        // Only one frame is queued, so rendering never runs further ahead of
+        // the screen than the number of buffers
+        SDL_LockMutex(present_mutex);
+        while (pending_buffer >= 0) {
+            SDL_CondWait(present_cond, present_mutex);
+        }
+        pending_buffer = back_buffer;
+        frames[back_buffer] = describe_frame();
+        SDL_CondBroadcast(present_cond);
+        SDL_UnlockMutex(present_mutex);
+        back_buffer = (back_buffer + 1) % NUM_COLOR_BUFFERS;
+        return;
+    }
+    frame_t frame = describe_frame();
+    if (is_color_buffer_locked) {
+        SDL_UnlockTexture(color_buffer_texture);
+        is_color_buffer_locked = false;
+        color_buffer = color_buffers[back_buffer];
+        color_pitch = buffer_pitch;
+    } else {
+        upload_frame(&frame, color_buffer);
+    }
+    SDL_Rect rect = frame.rect;
+    // The renderer scales the frame up to the whole window
+    SDL_RenderCopy(renderer, color_buffer_texture, &rect, NULL);
+    SDL_RenderPresent(renderer);
+}
+
+static void sdl_destroy(void) {
+    if (async_present && present_thread != NULL) {
+        // Frames already handed over are still presented
+        SDL_LockMutex(present_mutex);
+        should_stop_presenting = true;
+        SDL_CondBroadcast(present_cond);
+        SDL_UnlockMutex(present_mutex);
+        SDL_WaitThread(present_thread, NULL);
+        SDL_DestroyCond(present_cond);
+        SDL_DestroyMutex(present_mutex);
+    } else {
+        SDL_DestroyTexture(color_buffer_texture);
+        SDL_DestroyRenderer(renderer);
+    }
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+}
+
+// Called between frames with the new display size already set
+static void sdl_resize(void) {
+    if (async_present) {
+        // Idle once the last queued frame is uploaded, the texture is
+        // recreated before the next upload
+        SDL_LockMutex(present_mutex);
+        while (pending_buffer >= 0 || uploading_buffer >= 0) {
+            SDL_CondWait(present_cond, present_mutex);
+        }
+        should_resize_texture = true;
+        SDL_UnlockMutex(present_mutex);
+        return;
+    }
+    SDL_DestroyTexture(color_buffer_texture);
+    create_color_buffer_texture();
+}
+
+static const display_backend_t sdl_backend = {
+    sdl_initialize, sdl_lock_frame, sdl_present_frame, sdl_resize,
+    sdl_destroy};
+
+// Only the event subsystem is started, no video device is needed, keyboard
+// input from other sources and SIGINT still arrive as SDL events
+static bool offscreen_initialize(void) {
+    if (SDL_Init(SDL_INIT_EVENTS | SDL_INIT_TIMER) != 0) {
+        fprintf(stderr, "Error initializing SDL.\n");
         return false;
     }
-    SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
+    display_width = offscreen_width;
+    display_height = offscreen_height;
+    return true;
+}
 
-    color_buffer =
-        (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
-    z_buffer = (float *)malloc(sizeof(float) * window_width * window_height);
-    // Windows OS uses little endian, bytes in uint32_t are reversed
-    // SDL_PIXELFORMAT_RGBA32 is SDL_PIXELFORMAT_ABGR8888
-    // For 0xFF112233, FF is Alpha, 11 is Blue, 22 is Green, 33 is Red
-    color_buffer_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
-                                             SDL_TEXTUREACCESS_STREAMING,
-                                             window_width, window_height);
+static void offscreen_lock_frame(void) {
+    color_buffer = color_buffers[0];
+    color_pitch = buffer_pitch;
+}
+
+// Binary PPM, the color buffer holds R in the lowest byte or the top 5 bits
+static void write_ppm_frame(const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Error opening %s.\n", filename);
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", window_width, window_height);
+    frame_t frame = describe_frame();
+    int linear_pitch = window_width * frame.pixel_size;
+    uint8_t *pixels = (uint8_t *)malloc((size_t)linear_pitch * window_height);
+    copy_frame_rows(pixels, linear_pitch, color_buffer, &frame);
+    uint8_t *row = (uint8_t *)malloc(3 * window_width);
+    for (int y = 0; y < window_height; y++) {
+        if (color_format == COLOR_FORMAT_RGB565) {
+            uint16_t *colors = (uint16_t *)(pixels + linear_pitch * y);
+            for (int x = 0; x < window_width; x++) {
+                row[3 * x + 0] = ((colors[x] >> 11) & 0x1F) * 255 / 31;
+                row[3 * x + 1] = ((colors[x] >> 5) & 0x3F) * 255 / 63;
+                row[3 * x + 2] = (colors[x] & 0x1F) * 255 / 31;
+            }
+        } else {
+            uint32_t *colors = (uint32_t *)(pixels + linear_pitch * y);
+            for (int x = 0; x < window_width; x++) {
+                row[3 * x + 0] = colors[x] & 0xFF;
+                row[3 * x + 1] = (colors[x] >> 8) & 0xFF;
+                row[3 * x + 2] = (colors[x] >> 16) & 0xFF;
+            }
+        }
+        fwrite(row, 3, window_width, file);
+    }
+    free(row);
+    free(pixels);
+    fclose(file);
+}
+
+static void offscreen_present_frame(void) {
+    num_presented_frames++;
+    if (dump_directory != NULL) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s/frame_%05d.ppm",
+                 dump_directory, num_presented_frames);
+        write_ppm_frame(filename);
+    }
+}
+
+static void offscreen_resize(void) {}
+
+static void offscreen_destroy(void) { SDL_Quit(); }
+
+static const display_backend_t offscreen_backend = {
+    offscreen_initialize, offscreen_lock_frame, offscreen_present_frame,
+    offscreen_resize, offscreen_destroy};
+
+static const display_backend_t *backend = &sdl_backend;
 
+// Buffers are allocated for the display size, a lower render resolution uses
+// their first width * height pixels
+static void set_render_size(int width, int height) {
+    window_width = width;
+    window_height = height;
+    buffer_pitch = (window_width + PIXELS_PER_ALIGNMENT - 1) /
+                   PIXELS_PER_ALIGNMENT * PIXELS_PER_ALIGNMENT;
+    color_pitch = buffer_pitch;
+    // Epoch 0 is never current, so every segment starts out stale
+    if (tiled_layout) {
+        buffer_rows = (window_height + TILE_MASK) & ~TILE_MASK;
+        z_segments_per_row = buffer_pitch >> TILE_SHIFT;
+        z_num_segments = z_segments_per_row * (buffer_rows >> TILE_SHIFT);
+    } else {
+        buffer_rows = window_height;
+        z_segments_per_row =
+            (window_width + DEPTH_SEGMENT_SIZE - 1) >> DEPTH_SEGMENT_SHIFT;
+        z_num_segments = z_segments_per_row * window_height;
+    }
+    memset(z_segment_epochs, 0, sizeof(uint32_t) * z_num_segments);
+    z_epoch = 1;
+    history_buffer = NULL;
+    bake_background(background_color);
+    reset_scissor();
+}
+
+// Memory of one set of render targets, a new set is allocated in full before
+// it replaces the current one
+typedef struct {
+    void *color_buffers[NUM_COLOR_BUFFERS];
+    void *background_buffer;
+    void *z_buffer;
+    uint32_t *z_segment_epochs;
+} render_targets_t;
+
+static void free_render_targets(render_targets_t *targets) {
+    for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+        free_render_target(targets->color_buffers[i]);
+    }
+    free_render_target(targets->background_buffer);
+    free_render_target(targets->z_buffer);
+    free(targets->z_segment_epochs);
+}
+
+// Sized for the whole display with padded rows, every lower render
+// resolution fits in them. Returns false if any allocation failed, nothing
+// is left allocated then.
+static bool allocate_render_targets(int width, int height,
+                                    render_targets_t *targets) {
+    int max_pitch = (width + PIXELS_PER_ALIGNMENT - 1) /
+                    PIXELS_PER_ALIGNMENT * PIXELS_PER_ALIGNMENT;
+    int max_rows = (height + TILE_MASK) & ~TILE_MASK;
+    size_t num_pixels = (size_t)max_pitch * max_rows;
+    bool is_allocated = true;
+    for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+        targets->color_buffers[i] =
+            allocate_render_target(sizeof(uint32_t) * num_pixels);
+        is_allocated &= targets->color_buffers[i] != NULL;
+    }
+    targets->background_buffer =
+        allocate_render_target(sizeof(uint32_t) * num_pixels);
+    targets->z_buffer = allocate_render_target(sizeof(float) * num_pixels);
+    // Enough for the row segments of the linear layout or the tiles
+    int max_segments =
+        ((width + DEPTH_SEGMENT_SIZE - 1) >> DEPTH_SEGMENT_SHIFT) * height;
+    int max_tiles = (max_pitch >> TILE_SHIFT) * (max_rows >> TILE_SHIFT);
+    targets->z_segment_epochs = (uint32_t *)calloc(
+        max_segments > max_tiles ? max_segments : max_tiles, sizeof(uint32_t));
+    is_allocated &= targets->background_buffer != NULL &&
+                    targets->z_buffer != NULL &&
+                    targets->z_segment_epochs != NULL;
+    if (!is_allocated) {
+        fprintf(stderr, "Error allocating render targets for %dx%d.\n", width,
+                height);
+        free_render_targets(targets);
+    }
+    return is_allocated;
+}
+
+// The current targets are freed, nothing may read them anymore
+static void replace_render_targets(const render_targets_t *targets) {
+    render_targets_t current = {.background_buffer = background_buffer,
+                                .z_buffer = z_buffer,
+                                .z_segment_epochs = z_segment_epochs};
+    for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+        current.color_buffers[i] = color_buffers[i];
+        color_buffers[i] = targets->color_buffers[i];
+    }
+    free_render_targets(&current);
+    color_buffer = color_buffers[back_buffer];
+    background_buffer = targets->background_buffer;
+    z_buffer = targets->z_buffer;
+    z_segment_epochs = targets->z_segment_epochs;
+}
+
+bool initialize_window(void) {
+    render_targets_t targets;
+    if (!backend->initialize() ||
+        !allocate_render_targets(display_width, display_height, &targets)) {
+        return false;
+    }
+    replace_render_targets(&targets);
+    set_render_size(display_width, display_height);
     return true;
 }
 
-void draw_grid(void) {
+// Reallocate the render targets for a new display size, the render scale is
+// kept, must be called between frames. Returns false if they could not be
+// allocated, the old size and targets are kept then.
+bool resize_window(int width, int height) {
+    if (width <= 0 || height <= 0 ||
+        (width == display_width && height == display_height)) {
+        return true;
+    }
+    render_targets_t targets;
+    if (!allocate_render_targets(width, height, &targets)) {
+        return false;
+    }
+    display_width = width;
+    display_height = height;
+    // Waits until the present thread no longer reads the old targets
+    backend->resize();
+    replace_render_targets(&targets);
+    window_width = 0;
+    set_render_scale(render_scale);
+    return true;
+}
+
+// Offset in pixels of x, y in a buffer of buffer_pitch pixel rows
+static inline size_t get_pixel_index(int x, int y) {
+    if (tiled_layout) {
+        // Rows of tiles, then the rows of a tile
+        return (size_t)buffer_pitch * (y & ~TILE_MASK) +
+               ((x & ~TILE_MASK) << TILE_SHIFT) +
+               ((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+    }
+    return (size_t)buffer_pitch * y + x;
+}
+
+static void draw_grid(uint8_t *buffer) {
     int n = 10, m = 10;
+    int pixel_size = get_color_pixel_size();
+    uint32_t color = pack_color(0xFF333333);
     for (int y = 0; y < window_height; y += m) {
         for (int x = 0; x < window_width; x += m) {
             if (y % n == 0 || x % n == 0) {
-                color_buffer[window_width * y + x] = 0xFF333333;
+                store_pixel(&buffer[get_pixel_index(x, y) * pixel_size],
+                            color);
             }
         }
     }
 }
 
+// Generate the backdrop once per resolution and color format instead of
+// drawing it every frame
+void bake_background(uint32_t color) {
+    background_color = color;
+    int pixel_size = get_color_pixel_size();
+    uint32_t packed = pack_color(color);
+    uint8_t *pixels = background_buffer;
+    for (int i = 0; i < buffer_pitch * buffer_rows; i++) {
+        store_pixel(&pixels[i * pixel_size], packed);
+    }
+    draw_grid(background_buffer);
+}
+
+// The pixel accessors do not check bounds, callers clip against the scissor
+// rectangle once per span or primitive instead of once per pixel
 void draw_pixel(int x, int y, uint32_t color) {
-    if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
-        return;
+    store_pixel(get_color_pixel(x, y), pack_color(color));
+}
+
+// The locked texture has its own pitch, but it is only rendered into with the
+// linear layout
+void *get_color_pixel(int x, int y) {
+    if (tiled_layout) {
+        return (uint8_t *)color_buffer +
+               get_pixel_index(x, y) * get_color_pixel_size();
+    }
+    return (uint8_t *)color_buffer +
+           ((size_t)color_pitch * y + x) * get_color_pixel_size();
+}
+
+// Pixels x to the returned end are contiguous in both the color and the depth
+// buffer, the whole span with the linear layout, up to the end of the tile
+// row with the tiled one
+int get_contiguous_end(int x, int x_end) {
+    if (tiled_layout) {
+        int tile_end = x | TILE_MASK;
+        return tile_end < x_end ? tile_end : x_end;
     }
-    color_buffer[window_width * y + x] = color;
+    return x_end;
 }
 
+// Cohen-Sutherland region codes of a point against the scissor rectangle
+enum {
+    OUTCODE_INSIDE = 0,
+    OUTCODE_LEFT = 1,
+    OUTCODE_RIGHT = 2,
+    OUTCODE_TOP = 4,
+    OUTCODE_BOTTOM = 8
+};
+
+static int compute_outcode(int x, int y) {
+    int code = OUTCODE_INSIDE;
+    if (x < scissor.min_x) {
+        code |= OUTCODE_LEFT;
+    } else if (x >= scissor.max_x) {
+        code |= OUTCODE_RIGHT;
+    }
+    if (y < scissor.min_y) {
+        code |= OUTCODE_TOP;
+    } else if (y >= scissor.max_y) {
+        code |= OUTCODE_BOTTOM;
+    }
+    return code;
+}
+
+// Cohen-Sutherland, move the end points onto the scissor rectangle,
+// returns false if the line is completely outside
+static bool clip_line_to_scissor(int *x0, int *y0, int *x1, int *y1) {
+    int code0 = compute_outcode(*x0, *y0);
+    int code1 = compute_outcode(*x1, *y1);
+    while (true) {
+        if (!(code0 | code1)) {
+            return true;
+        }
+        if (code0 & code1) {
+            return false;
+        }
+        // Wide integers, the slope products overflow 32 bits for far points
+        int64_t dx = (int64_t)*x1 - *x0;
+        int64_t dy = (int64_t)*y1 - *y0;
+        int code = code0 ? code0 : code1;
+        int64_t x, y;
+        if (code & OUTCODE_BOTTOM) {
+            y = scissor.max_y - 1;
+            x = *x0 + dx * (y - *y0) / dy;
+        } else if (code & OUTCODE_TOP) {
+            y = scissor.min_y;
+            x = *x0 + dx * (y - *y0) / dy;
+        } else if (code & OUTCODE_RIGHT) {
+            x = scissor.max_x - 1;
+            y = *y0 + dy * (x - *x0) / dx;
+        } else {
+            x = scissor.min_x;
+            y = *y0 + dy * (x - *x0) / dx;
+        }
+        if (code == code0) {
+            *x0 = (int)x;
+            *y0 = (int)y;
+            code0 = compute_outcode(*x0, *y0);
+        } else {
+            *x1 = (int)x;
+            *y1 = (int)y;
+            code1 = compute_outcode(*x1, *y1);
+        }
+    }
+}
+
+// Bresenham stepping coordinates, tiled rows have no constant pitch to step
+// a pointer by
+static void draw_line_pixels(int x0, int y0, int x1, int y1,
+                             uint32_t packed) {
+    int delta_x = abs(x1 - x0);
+    int delta_y = -abs(y1 - y0);
+    int step_x = x0 < x1 ? 1 : -1;
+    int step_y = y0 < y1 ? 1 : -1;
+    int error = delta_x + delta_y;
+    while (true) {
+        store_pixel(get_color_pixel(x0, y0), packed);
+        if (x0 == x1 && y0 == y1) {
+            break;
+        }
+        int error2 = 2 * error;
+        if (error2 >= delta_y) {
+            error += delta_y;
+            x0 += step_x;
+        }
+        if (error2 <= delta_x) {
+            error += delta_x;
+            y0 += step_y;
+        }
+    }
+}
+
+// Lines in the linear layout with the pixels of one color format, horizontal
+// runs are plain fills and the other lines step a pointer of the pixel type.
+// Bresenham, the error term tracks both axes so one loop covers every octant.
+#define DEFINE_DRAW_LINEAR_LINE(name, type)                                    \
+    static void name(int x0, int y0, int x1, int y1, type value) {             \
+        if (y0 == y1) {                                                        \
+            type *row = get_color_pixel(x0 < x1 ? x0 : x1, y0);                \
+            int count = abs(x1 - x0) + 1;                                      \
+            for (int i = 0; i < count; i++) {                                  \
+                row[i] = value;                                                \
+            }                                                                  \
+            return;                                                            \
+        }                                                                      \
+        type *pixel = get_color_pixel(x0, y0);                                 \
+        int step_y = y0 < y1 ? color_pitch : -color_pitch;                     \
+        if (x0 == x1) {                                                        \
+            int count = abs(y1 - y0) + 1;                                      \
+            for (int i = 0; i < count; i++) {                                  \
+                *pixel = value;                                                \
+                pixel += step_y;                                               \
+            }                                                                  \
+            return;                                                            \
+        }                                                                      \
+        int delta_x = abs(x1 - x0);                                            \
+        int delta_y = -abs(y1 - y0);                                           \
+        int step_x = x0 < x1 ? 1 : -1;                                         \
+        int error = delta_x + delta_y;                                         \
+        type *last = get_color_pixel(x1, y1);                                  \
+        while (true) {                                                         \
+            *pixel = value;                                                    \
+            if (pixel == last) {                                               \
+                break;                                                         \
+            }                                                                  \
+            int error2 = 2 * error;                                            \
+            if (error2 >= delta_y) {                                           \
+                error += delta_y;                                              \
+                pixel += step_x;                                               \
+            }                                                                  \
+            if (error2 <= delta_x) {                                           \
+                error += delta_x;                                              \
+                pixel += step_y;                                               \
+            }                                                                  \
+        }                                                                      \
+    }
+
+DEFINE_DRAW_LINEAR_LINE(draw_linear_line_rgb565, uint16_t)
+DEFINE_DRAW_LINEAR_LINE(draw_linear_line_rgba8888, uint32_t)
+
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
-    // Digital Differential Analyzer
-    int delta_x = (x1 - x0);
-    int delta_y = (y1 - y0);
-    int longest_side_length =
-        (abs(delta_x) >= abs(delta_y)) ? abs(delta_x) : abs(delta_y);
-    float x_inc = delta_x / (float)longest_side_length;
-    float y_inc = delta_y / (float)longest_side_length;
-    float current_x = x0;
-    float current_y = y0;
-    for (int i = 0; i <= longest_side_length; i++) {
-        draw_pixel(round(current_x), round(current_y), color);
-        current_x += x_inc;
-        current_y += y_inc;
+    // Clip once, the loops below write to the color buffer unchecked
+    if (!clip_line_to_scissor(&x0, &y0, &x1, &y1)) {
+        return;
+    }
+    // The layout and the format are resolved once per line
+    uint32_t packed = pack_color(color);
+    if (tiled_layout) {
+        draw_line_pixels(x0, y0, x1, y1, packed);
+    } else if (color_format == COLOR_FORMAT_RGB565) {
+        draw_linear_line_rgb565(x0, y0, x1, y1, (uint16_t)packed);
+    } else {
+        draw_linear_line_rgba8888(x0, y0, x1, y1, packed);
     }
 }
 
 void draw_rect(int x, int y, int width, int height, uint32_t color) {
-    for (int j = y; j < y + height; j++) {
-        for (int i = x; i < x + width; i++) {
-            draw_pixel(i, j, color);
+    int x_start = x > scissor.min_x ? x : scissor.min_x;
+    int y_start = y > scissor.min_y ? y : scissor.min_y;
+    int x_end = x + width < scissor.max_x ? x + width : scissor.max_x;
+    int y_end = y + height < scissor.max_y ? y + height : scissor.max_y;
+    int pixel_size = get_color_pixel_size();
+    uint32_t packed = pack_color(color);
+    for (int j = y_start; j < y_end; j++) {
+        int i = x_start;
+        while (i < x_end) {
+            int run_end = get_contiguous_end(i, x_end - 1);
+            uint8_t *run = get_color_pixel(i, j);
+            for (; i <= run_end; i++) {
+                store_pixel(run, packed);
+                run += pixel_size;
+            }
         }
     }
 }
 
-void clear_color_buffer(uint32_t color) {
-    for (int i = 0; i < window_width * window_height; i++) {
-        color_buffer[i] = color;
+// Only starts a new depth epoch, the buffer itself is reset segment by
+// segment in prepare_zbuffer_span
+void clear_z_buffer() {
+    z_epoch++;
+    if (z_epoch == 0) {
+        // Wrapped around, old epochs could look current again, and the
+        // depth of the previous frame is lost for interlacing
+        memset(z_segment_epochs, 0, sizeof(uint32_t) * z_num_segments);
+        z_epoch = 1;
+        history_buffer = NULL;
     }
 }
 
-void clear_z_buffer() {
-    for (int i = 0; i < window_width * window_height; i++) {
-        // After applied perspective projection, value of z has been between
-        // 0 and 1, 0 is znear, 1 is zfar, smaller z is, closer to screen
-        // the pixel is
-        z_buffer[i] = 1.0f;
+// Alternates the field of an interlaced frame, the skipped rows are rebuilt
+// from the previous frame and its depth, so it must be at hand. Depth is kept
+// per row only with the linear layout and is not written by the span buffer
+// or without the depth test.
+static void start_interlaced_field(void) {
+    bool can_interlace = interlaced && !tiled_layout && depth_test &&
+                         visibility_method != VISIBILITY_SPAN_BUFFER &&
+                         history_buffer != NULL && !is_color_buffer_locked &&
+                         window_height >= 2;
+    interlace_field = can_interlace ? (interlace_field == 0 ? 1 : 0) : -1;
+}
+
+// Copies the buffer over the whole color buffer, rows of the locked texture
+// may have another pitch
+static void copy_color_frame(const void *source) {
+    int pixel_size = get_color_pixel_size();
+    if (color_pitch == buffer_pitch) {
+        memcpy(color_buffer, source,
+               (size_t)pixel_size * buffer_pitch * buffer_rows);
+        return;
+    }
+    for (int y = 0; y < window_height; y++) {
+        memcpy(get_color_pixel(0, y),
+               (const uint8_t *)source + (size_t)pixel_size * buffer_pitch * y,
+               (size_t)pixel_size * window_width);
+    }
+}
+
+// Restore the baked background, a block copy replaces the clear and the grid
+void clear_buffers(void) {
+    int pixel_size = get_color_pixel_size();
+    start_interlaced_field();
+    if (interlace_field >= 0) {
+        // Rows of the other field are rebuilt after rasterization
+        for (int y = interlace_field; y < window_height; y += 2) {
+            size_t offset = (size_t)pixel_size * buffer_pitch * y;
+            memcpy((uint8_t *)color_buffer + offset,
+                   (uint8_t *)background_buffer + offset,
+                   (size_t)pixel_size * window_width);
+        }
+    } else {
+        copy_color_frame(background_buffer);
+    }
+    clear_z_buffer();
+}
+
+// After applied perspective projection, value of z has been between 0 and 1,
+// 0 is znear, 1 is zfar, smaller z is, closer to screen the pixel is
+static void fill_depth(void *depth, int count) {
+    if (depth_format == DEPTH_FORMAT_UNORM16) {
+        uint16_t *values = depth;
+        for (int i = 0; i < count; i++) {
+            values[i] = 0xFFFF;
+        }
+    } else {
+        float *values = depth;
+        for (int i = 0; i < count; i++) {
+            values[i] = 1.0f;
+        }
+    }
+}
+
+// Must be called before the depth of a span is read in the frame
+void prepare_zbuffer_span(int y, int x_start, int x_end) {
+    if (tiled_layout) {
+        // A stale tile is reset as a whole, it is a contiguous block
+        uint32_t *epochs =
+            &z_segment_epochs[(y >> TILE_SHIFT) * z_segments_per_row];
+        for (int tile = x_start >> TILE_SHIFT; tile <= x_end >> TILE_SHIFT;
+             tile++) {
+            if (epochs[tile] != z_epoch) {
+                epochs[tile] = z_epoch;
+                fill_depth(get_zbuffer_pixel(tile << TILE_SHIFT,
+                                             y & ~TILE_MASK),
+                           TILE_SIZE * TILE_SIZE);
+            }
+        }
+        return;
+    }
+    uint32_t *epochs = &z_segment_epochs[y * z_segments_per_row];
+    int last_segment = x_end >> DEPTH_SEGMENT_SHIFT;
+    for (int segment = x_start >> DEPTH_SEGMENT_SHIFT;
+         segment <= last_segment; segment++) {
+        if (epochs[segment] == z_epoch) {
+            continue;
+        }
+        epochs[segment] = z_epoch;
+        int x = segment << DEPTH_SEGMENT_SHIFT;
+        int end = x + DEPTH_SEGMENT_SIZE < window_width
+                      ? x + DEPTH_SEGMENT_SIZE
+                      : window_width;
+        fill_depth(get_zbuffer_pixel(x, y), end - x);
+    }
+}
+
+// Rows of a rectangle at once, for primitives too small to pay for a call
+// on every span. Rows of the field an interlaced frame skips keep the depth
+// of the previous frame.
+void prepare_zbuffer_rect(int x_start, int y_start, int x_end, int y_end) {
+    for (int y = y_start; y <= y_end; y++) {
+        if (interlace_field >= 0 && (y & 1) != interlace_field) {
+            continue;
+        }
+        prepare_zbuffer_span(y, x_start, x_end);
+        if (tiled_layout) {
+            // The span prepared whole tiles, skip to the next row of them
+            y |= TILE_MASK;
+        }
+    }
+}
+
+// Depth written in the frame is reset inside the rectangle, stale segments
+// are still reset as a whole when the span is prepared
+static void reset_depth_rect(scissor_t rect) {
+    for (int y = rect.min_y; y < rect.max_y; y++) {
+        int x = rect.min_x;
+        while (x < rect.max_x) {
+            int end = get_contiguous_end(x, rect.max_x - 1);
+            uint32_t epoch;
+            if (tiled_layout) {
+                epoch = z_segment_epochs[(y >> TILE_SHIFT) *
+                                             z_segments_per_row +
+                                         (x >> TILE_SHIFT)];
+            } else {
+                int segment_end = x | (DEPTH_SEGMENT_SIZE - 1);
+                end = segment_end < end ? segment_end : end;
+                epoch = z_segment_epochs[y * z_segments_per_row +
+                                         (x >> DEPTH_SEGMENT_SHIFT)];
+            }
+            if (epoch == z_epoch) {
+                fill_depth(get_zbuffer_pixel(x, y), end - x + 1);
+            }
+            x = end + 1;
+        }
+    }
+}
+
+// Keeps the previous frame outside of the rectangle, color and depth, and
+// restores the background inside of it, where all rows are rasterized even
+// while interlaced. Returns false if the previous frame cannot be read back.
+bool clear_buffers_rect(scissor_t rect) {
+    rect.min_x = rect.min_x > 0 ? rect.min_x : 0;
+    rect.min_y = rect.min_y > 0 ? rect.min_y : 0;
+    rect.max_x = rect.max_x < window_width ? rect.max_x : window_width;
+    rect.max_y = rect.max_y < window_height ? rect.max_y : window_height;
+    if (rect.min_x == 0 && rect.min_y == 0 && rect.max_x == window_width &&
+        rect.max_y == window_height) {
+        // Nothing of the previous frame is kept
+        copy_color_frame(background_buffer);
+        clear_z_buffer();
+        interlace_field = -1;
+        return true;
     }
+    if (history_buffer == NULL) {
+        return false;
+    }
+    int pixel_size = get_color_pixel_size();
+    if (history_buffer != color_buffer) {
+        copy_color_frame(history_buffer);
+    }
+    for (int y = rect.min_y; y < rect.max_y; y++) {
+        int x = rect.min_x;
+        while (x < rect.max_x) {
+            int end = get_contiguous_end(x, rect.max_x - 1);
+            memcpy(get_color_pixel(x, y),
+                   (uint8_t *)background_buffer +
+                       get_pixel_index(x, y) * pixel_size,
+                   (size_t)pixel_size * (end - x + 1));
+            x = end + 1;
+        }
+    }
+    // The depth epoch stays, segments written by the previous frame still
+    // hold its depth outside of the rectangle
+    reset_depth_rect(rect);
+    interlace_field = -1;
+    return true;
+}
+
+// Holds floats or 16-bit unorm values depending on the depth format
+void *get_zbuffer_pixel(int x, int y) {
+    size_t depth_size = depth_format == DEPTH_FORMAT_UNORM16 ? sizeof(uint16_t)
+                                                             : sizeof(float);
+    return (uint8_t *)z_buffer + get_pixel_index(x, y) * depth_size;
+}
+
+static uint32_t load_pixel(const uint8_t *pixel) {
+    if (color_format == COLOR_FORMAT_RGB565) {
+        return *(const uint16_t *)pixel;
+    }
+    return *(const uint32_t *)pixel;
 }
 
-float get_zbuffer_at(int x, int y) {
-    // No clipping, y maybe greater than window_height, then segmentation fault
-    // when access z-buffer
-    // After clipping, y still can be window_height
-    if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
-        // Prevent segmentation fault when access z-buffer
-        return 1.0f;
+// Per channel average of two packed colors, the low bit of every channel is
+// dropped so the halves cannot carry into the next channel
+static uint32_t average_pixels(uint32_t a, uint32_t b) {
+    uint32_t mask = color_format == COLOR_FORMAT_RGB565 ? 0xF7DE : 0xFEFEFEFE;
+    return ((a & mask) >> 1) + ((b & mask) >> 1);
+}
+
+// 1/w scaled to [0, 1], 0 where nothing was drawn in the frame the depth is
+// from, so the background matches itself
+static float get_depth_reciprocal(int x, int y, bool is_drawn) {
+    if (!is_drawn) {
+        return 0.0f;
+    }
+    if (depth_format == DEPTH_FORMAT_UNORM16) {
+        return (65535 - *(uint16_t *)get_zbuffer_pixel(x, y)) / 65535.0f;
     }
-    return z_buffer[y * window_width + x];
+    return 1.0f - *(float *)get_zbuffer_pixel(x, y);
 }
 
-void update_zbuffer_at(int x, int y, float value) {
-    if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+static bool is_same_surface(float a, float b) {
+    return fabsf(a - b) <= INTERLACE_DEPTH_TOLERANCE * (a > b ? a : b);
+}
+
+// A pixel of a skipped row keeps the previous frame where it continues the
+// surface of a neighbour row, the background where no frame drew anything,
+// and the average of the rows above and below elsewhere
+static void reconstruct_segment(int y, int x_start, int x_end, int above,
+                                int below, bool is_previous_drawn,
+                                bool is_above_drawn, bool is_below_drawn) {
+    int pixel_size = get_color_pixel_size();
+    for (int x = x_start; x < x_end; x++) {
+        float previous = get_depth_reciprocal(x, y, is_previous_drawn);
+        float depth_above = get_depth_reciprocal(x, above, is_above_drawn);
+        float depth_below = get_depth_reciprocal(x, below, is_below_drawn);
+        size_t offset = get_pixel_index(x, y) * pixel_size;
+        uint32_t color;
+        if (previous == 0.0f && depth_above == 0.0f && depth_below == 0.0f) {
+            color = load_pixel((uint8_t *)background_buffer + offset);
+        } else if (is_same_surface(previous, depth_above) ||
+                   is_same_surface(previous, depth_below)) {
+            color = load_pixel((uint8_t *)history_buffer + offset);
+        } else {
+            color = average_pixels(load_pixel(get_color_pixel(x, above)),
+                                   load_pixel(get_color_pixel(x, below)));
+        }
+        store_pixel((uint8_t *)color_buffer + offset, color);
+    }
+}
+
+// Depth segments of the skipped rows were last written by the previous
+// frame, the ones of the rasterized rows by this one
+void reconstruct_interlaced_rows(void) {
+    if (interlace_field < 0) {
         return;
     }
-    z_buffer[y * window_width + x] = value;
+    for (int y = 1 - interlace_field; y < window_height; y += 2) {
+        int above = y > 0 ? y - 1 : y + 1;
+        int below = y + 1 < window_height ? y + 1 : y - 1;
+        uint32_t *epochs = &z_segment_epochs[y * z_segments_per_row];
+        uint32_t *epochs_above = &z_segment_epochs[above * z_segments_per_row];
+        uint32_t *epochs_below = &z_segment_epochs[below * z_segments_per_row];
+        for (int segment = 0; segment < z_segments_per_row; segment++) {
+            int x = segment << DEPTH_SEGMENT_SHIFT;
+            int end = x + DEPTH_SEGMENT_SIZE < window_width
+                          ? x + DEPTH_SEGMENT_SIZE
+                          : window_width;
+            bool is_previous_drawn = epochs[segment] == z_epoch - 1;
+            bool is_above_drawn = epochs_above[segment] == z_epoch;
+            bool is_below_drawn = epochs_below[segment] == z_epoch;
+            if (!is_previous_drawn && !is_above_drawn && !is_below_drawn) {
+                size_t offset = get_pixel_index(x, y) * get_color_pixel_size();
+                memcpy((uint8_t *)color_buffer + offset,
+                       (uint8_t *)background_buffer + offset,
+                       (size_t)(end - x) * get_color_pixel_size());
+                continue;
+            }
+            reconstruct_segment(y, x, end, above, below, is_previous_drawn,
+                                is_above_drawn, is_below_drawn);
+        }
+    }
 }
 
+void lock_color_buffer(void) { backend->lock_frame(); }
+
+// Frames rendered into the locked texture cannot be read back
 void render_color_buffer(void) {
-    SDL_UpdateTexture(color_buffer_texture, NULL, color_buffer,
-                      (int)sizeof(uint32_t) * window_width);
-    SDL_RenderCopy(renderer, color_buffer_texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+    history_buffer = is_color_buffer_locked ? NULL : color_buffer;
+    backend->present_frame();
 }
 
 void destroy_window(void) {
-    free(color_buffer);
-    free(z_buffer);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    // Stops the present thread before the buffers it reads are freed
+    backend->destroy();
+    render_targets_t none = {0};
+    replace_render_targets(&none);
+}
+
+scissor_t get_scissor(void) { return scissor; }
+
+// Clamped to the window, so clipping against it keeps accesses in the buffers
+void set_scissor(int x, int y, int width, int height) {
+    scissor.min_x = x > 0 ? x : 0;
+    scissor.min_y = y > 0 ? y : 0;
+    scissor.max_x = x + width < window_width ? x + width : window_width;
+    scissor.max_y = y + height < window_height ? y + height : window_height;
+}
+
+void reset_scissor(void) {
+    set_scissor(0, 0, window_width, window_height);
 }
 
 bool should_cull_backface(void) { return cull_method == CULL_BACKFACE; }
 
+bool should_test_depth(void) { return depth_test; }
+
 bool should_render_filled_triangle(void) {
     return render_method == RENDER_FILL_TRIANGLE ||
            render_method == RENDER_FILL_TRIANGLE_WIRE;
@@ -169,6 +1239,28 @@ bool should_render_wire_vertex(void) {
     return render_method == RENDER_WIRE_VERTEX;
 }
 
+// Wireframe without fill, drawn from the mesh edges instead of the triangles
+bool should_render_mesh_wireframe(void) {
+    return render_method == RENDER_WIRE ||
+           render_method == RENDER_WIRE_VERTEX;
+}
+
+render_state_t get_render_state(void) {
+    render_state_t state = {.filled = should_render_filled_triangle(),
+                            .textured = should_render_textured_triangle(),
+                            .wireframe = should_render_wireframe(),
+                            .wire_vertex = should_render_wire_vertex(),
+                            .depth_test = should_test_depth(),
+                            .visibility = visibility_method,
+                            .variable_rate_shading = variable_rate_shading,
+                            .color_format = color_format,
+                            .depth_format = depth_format};
+    return state;
+}
+
+// Setters take effect from the next frame and must not be called while one is
+// rendered, the backend and the way frames are presented are chosen before
+// initialize_window
 int get_window_width(void) { return window_width; }
 
 int get_window_height(void) { return window_height; }
@@ -176,3 +1268,91 @@ int get_window_height(void) { return window_height; }
 void set_render_method(int method) { render_method = method; }
 
 void set_cull_method(int method) { cull_method = method; }
+
+float get_render_scale(void) { return render_scale; }
+
+// Scale of the internal render resolution relative to the display
+void set_render_scale(float scale) {
+    scale = scale < 0.1f ? 0.1f : (scale > 1.0f ? 1.0f : scale);
+    render_scale = scale;
+    int width = (int)(display_width * scale + 0.5f);
+    int height = (int)(display_height * scale + 0.5f);
+    width = width > 0 ? width : 1;
+    height = height > 0 ? height : 1;
+    if (width != window_width || height != window_height) {
+        set_render_size(width, height);
+    }
+}
+
+void set_zero_copy_present(bool enabled) { zero_copy_present = enabled; }
+
+// Zero-copy presentation only applies without it
+void set_async_present(bool enabled) { async_present = enabled; }
+
+// Renders without a window, presented frames are written to dump_dir if set
+void set_offscreen_display(int width, int height, const char *dump_dir) {
+    offscreen_width = width;
+    offscreen_height = height;
+    dump_directory = dump_dir;
+    backend = &offscreen_backend;
+}
+
+void set_depth_test(bool enabled) { depth_test = enabled; }
+
+int get_visibility_method(void) { return visibility_method; }
+
+void set_visibility_method(int method) { visibility_method = method; }
+
+int get_color_format(void) { return color_format; }
+
+int get_depth_format(void) { return depth_format; }
+
+// Before initialize_window the formats are only recorded
+void set_render_target_formats(int color, int depth) {
+    bool color_changed = color != color_format;
+    bool depth_changed = depth != depth_format;
+    color_format = color;
+    depth_format = depth;
+    if (background_buffer == NULL || (!color_changed && !depth_changed)) {
+        return;
+    }
+    if (color_changed) {
+        // Recreates the texture in the new format
+        backend->resize();
+    }
+    // Rebakes the background and marks every depth segment stale
+    set_render_size(window_width, window_height);
+}
+
+bool is_tiled_layout(void) { return tiled_layout; }
+
+// Frames already queued for presentation keep the layout they were drawn with
+void set_tiled_layout(bool enabled) {
+    if (enabled == tiled_layout) {
+        return;
+    }
+    tiled_layout = enabled;
+    if (background_buffer != NULL) {
+        set_render_size(window_width, window_height);
+    }
+}
+
+bool is_interlaced(void) { return interlaced; }
+
+// The next frame still renders all rows, later ones alternate the fields
+void set_interlaced(bool enabled) { interlaced = enabled; }
+
+int get_interlaced_field(void) { return interlace_field; }
+
+bool is_variable_rate_shading(void) { return variable_rate_shading; }
+
+// Textured triangles whose texture is magnified enough get one texture
+// sample for every 2x2 pixel block, depth is still tested per pixel
+void set_variable_rate_shading(bool enabled) {
+    variable_rate_shading = enabled;
+}
+
+float get_depth_near(void) { return depth_near; }
+
+// 16-bit depth stores 1 - znear / w, which spans [0, 1) in front of znear
+void set_depth_near(float znear) { depth_near = znear; }
@@ -7,8 +7,27 @@
 #define FPS 60
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+#define WIRE_COLOR 0xFF00FF00
+#define VERTEX_COLOR 0xFF0000FF
+
 enum { CULL_NONE, CULL_BACKFACE };
 
+// How the rasterizer resolves which triangle is visible at a pixel when the
+// depth test is on, the span buffer shades every visible span once instead
+// of testing and shading every fragment, the depth pre-pass fills the depth
+// buffer first and shades only the fragments that end up visible
+enum {
+    VISIBILITY_DEPTH_BUFFER,
+    VISIBILITY_SPAN_BUFFER,
+    VISIBILITY_DEPTH_PREPASS,
+    NUM_VISIBILITY_METHODS
+};
+
+// Pixel formats of the render targets, the 16-bit ones halve the memory
+// traffic of the rasterizer and the upload
+enum { COLOR_FORMAT_RGBA8888, COLOR_FORMAT_RGB565 };
+enum { DEPTH_FORMAT_FLOAT, DEPTH_FORMAT_UNORM16 };
+
 enum {
     RENDER_WIRE,
     RENDER_WIRE_VERTEX,
@@ -18,27 +37,88 @@ enum {
     RENDER_TEXTURED_WIRE
 };
 
+// Render settings read once per frame by the rasterizer
+typedef struct {
+    bool filled;
+    bool textured;
+    bool wireframe;
+    bool wire_vertex;
+    bool depth_test;
+    int visibility;
+    bool variable_rate_shading;
+    int color_format;
+    int depth_format;
+} render_state_t;
+
+// Rectangle drawing is limited to, max_x and max_y are exclusive
+typedef struct {
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+} scissor_t;
+
+// Colors are 0xAABBGGRR, R is the lowest byte
+static inline uint16_t pack_rgb565(uint32_t color) {
+    return (uint16_t)(((color & 0xF8) << 8) | ((color >> 5) & 0x07E0) |
+                      ((color >> 19) & 0x1F));
+}
+
 bool initialize_window(void);
-void draw_grid(void);
+void bake_background(uint32_t color);
 void draw_pixel(int x, int y, uint32_t color);
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
 void draw_rect(int x, int y, int width, int height, uint32_t color);
+void lock_color_buffer(void);
 void render_color_buffer(void);
-void clear_color_buffer(uint32_t color);
 void clear_z_buffer();
-float get_zbuffer_at(int x, int y);
-void update_zbuffer_at(int x, int y, float value);
+void clear_buffers(void);
+bool clear_buffers_rect(scissor_t rect);
+void reconstruct_interlaced_rows(void);
+void prepare_zbuffer_span(int y, int x_start, int x_end);
+void prepare_zbuffer_rect(int x_start, int y_start, int x_end, int y_end);
+void *get_color_pixel(int x, int y);
+void *get_zbuffer_pixel(int x, int y);
+int get_contiguous_end(int x, int x_end);
+bool resize_window(int width, int height);
 void destroy_window(void);
 
+scissor_t get_scissor(void);
+void set_scissor(int x, int y, int width, int height);
+void reset_scissor(void);
+
 bool should_cull_backface(void);
+bool should_test_depth(void);
 bool should_render_filled_triangle(void);
 bool should_render_textured_triangle(void);
 bool should_render_wireframe(void);
 bool should_render_wire_vertex(void);
+bool should_render_mesh_wireframe(void);
+render_state_t get_render_state(void);
 
 int get_window_width(void);
 int get_window_height(void);
 void set_render_method(int method);
 void set_cull_method(int method);
+void set_depth_test(bool enabled);
+int get_visibility_method(void);
+void set_visibility_method(int method);
+float get_render_scale(void);
+void set_render_scale(float scale);
+void set_zero_copy_present(bool enabled);
+void set_async_present(bool enabled);
+void set_offscreen_display(int width, int height, const char *dump_dir);
+int get_color_format(void);
+int get_depth_format(void);
+void set_render_target_formats(int color, int depth);
+bool is_tiled_layout(void);
+void set_tiled_layout(bool enabled);
+bool is_interlaced(void);
+void set_interlaced(bool enabled);
+int get_interlaced_field(void);
+bool is_variable_rate_shading(void);
+void set_variable_rate_shading(bool enabled);
+float get_depth_near(void);
+void set_depth_near(float znear);
 
 #endif
@@ -1,4 +1,5 @@
 #include "array.h"
+#include "bsp.h"
 #include "camera.h"
 #include "clipping.h"
 #include "display.h"
@@ -6,34 +7,92 @@
 #include "matrix.h"
 #include "mesh.h"
 #include "texture.h"
-#include "upng.h"
 #include "vector.h"
 #include <SDL_keycode.h>
 #include <SDL_pixels.h>
 #include <SDL_timer.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define MAX_TRIANGLES_PER_MESH 10000
+#define NUM_DEPTH_BUCKETS 16
+#define MAX_SORT_TEXTURES 16
+#define MAX_LINES_TO_RENDER 30000
+#define MAX_POINTS_TO_RENDER 10000
+// Dynamic resolution steps the render scale by RENDER_SCALE_STEP, looking at
+// the frame time averaged over at least RENDER_SCALE_FRAMES frames
+#define RENDER_SCALE_MIN 0.5f
+#define RENDER_SCALE_STEP 0.1f
+#define RENDER_SCALE_FRAMES 30
+
+typedef struct {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} line_t;
+
+typedef struct {
+    int x;
+    int y;
+} point_t;
 
 // Array of triangles that should be rendered frame by frame
 triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
 int num_triangles_to_render = 0;
+// Scratch space of the render queue sort
+triangle_t sorted_triangles[MAX_TRIANGLES_PER_MESH];
+int sort_keys[MAX_TRIANGLES_PER_MESH];
+
+// Mesh wireframe overlay, every visible edge and vertex once per frame
+line_t lines_to_render[MAX_LINES_TO_RENDER];
+int num_lines_to_render = 0;
+point_t points_to_render[MAX_POINTS_TO_RENDER];
+int num_points_to_render = 0;
+// Camera space vertices of the mesh whose overlay is being built
+vec3_t *view_vertices = NULL;
 
 mat4_t world_matrix;
 mat4_t proj_matrix;
 mat4_t view_matrix;
 
 bool is_running = false;
+// Benchmarks run offscreen as fast as possible for a fixed number of frames
+bool limit_frame_rate = true;
+int max_frames = 0;
+int num_frames = 0;
+// Drop pixels rather than frames when rendering gets too slow
+bool dynamic_resolution = true;
+Uint64 frame_start_counter = 0;
+float average_frame_ms = 0.0f;
+int frames_since_scale_change = 0;
+bool use_bsp_order = false;
+// Picked on the command line, the keys switch it at run time
+int initial_render_method = RENDER_WIRE;
+bool use_texture_atlas = false;
+bool animate_mesh = false;
 int previous_frame_time = 0;
 float delta_time;
 
-void setup(void) {
-    set_render_method(RENDER_WIRE);
-    set_cull_method(CULL_BACKFACE);
-
-    // Initialize the scene light direction
-    init_light(vec3_new(0, 0, 1));
-
+// How a frame is drawn, decided from what changed since the last presented
+// frame. Nothing changed: skipped, or drawn once more without interlacing if
+// that only approximated the presented frame. Only one mesh moved: just the
+// screen bounds it left and entered are drawn again.
+enum { FRAME_SKIPPED, FRAME_EXACT, FRAME_DIRTY_RECT, FRAME_FULL };
+bool skip_unchanged_frames = true;
+int frame_mode = FRAME_FULL;
+// Render state only changes on input, so any input redraws the whole frame
+bool needs_full_redraw = true;
+bool are_meshes_moved = false;
+mesh_t *moved_mesh = NULL;
+bool is_presented_frame_approximate = false;
+mat4_t presented_view_matrix;
+int presented_width = 0;
+int presented_height = 0;
+
+// The aspect ratio follows the window, so this runs again on every resize
+void init_projection(void) {
     // Initialize the perspective projection matrix
     float aspectx = (float)get_window_width() / (float)get_window_height();
     float aspecty = (float)get_window_height() / (float)get_window_width();
@@ -42,9 +101,21 @@ void setup(void) {
     float znear = 0.1f;
     float zfar = 100.0f;
     proj_matrix = mat4_make_perspective(fovy, aspecty, znear, zfar);
+    set_depth_near(znear);
 
     // Initialize frustum planes with a point and a normal
     init_frustum_planes(fovx, fovy, znear, zfar);
+}
+
+void setup(void) {
+    set_render_method(initial_render_method);
+    set_cull_method(CULL_BACKFACE);
+    bake_background(0xFF000000);
+
+    // Initialize the scene light direction
+    init_light(vec3_new(0, 0, 1));
+
+    init_projection();
 
     // load_cube_mesh_data();
     load_mesh("./assets/f22.obj", "./assets/f22.png", vec3_new(1, 1, 1),
@@ -53,6 +124,12 @@ void setup(void) {
               vec3_new(0, -M_PI / 2, 0), vec3_new(-3, -1.3, +9));
     load_mesh("./assets/f117.obj", "./assets/f117.png", vec3_new(1, 1, 1),
               vec3_new(0, -M_PI / 2, 0), vec3_new(+3, -1.3, +9));
+
+    // Merge the mesh textures into one atlas, so triangles of different
+    // meshes do not switch between texture working sets
+    if (use_texture_atlas) {
+        pack_mesh_texture_atlas();
+    }
 }
 
 void process_input(void) {
@@ -62,8 +139,18 @@ void process_input(void) {
         case SDL_QUIT:
             is_running = false;
             break;
+        case SDL_WINDOWEVENT:
+            // Exposed or resized windows show the frame again
+            needs_full_redraw = true;
+            // The old size is kept if the new one cannot be allocated
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED &&
+                resize_window(event.window.data1, event.window.data2)) {
+                init_projection();
+            }
+            break;
         case SDL_KEYDOWN:
             SDL_Keycode sym = event.key.keysym.sym;
+            needs_full_redraw = true;
             if (sym == SDLK_ESCAPE) {
                 is_running = false;
                 break;
@@ -100,6 +187,55 @@ void process_input(void) {
                 set_cull_method(CULL_NONE);
                 break;
             }
+            if (sym == SDLK_0) {
+                dynamic_resolution = !dynamic_resolution;
+                if (!dynamic_resolution) {
+                    set_render_scale(1.0f);
+                }
+                break;
+            }
+            if (sym == SDLK_F1) {
+                set_render_target_formats(
+                    get_color_format() == COLOR_FORMAT_RGB565
+                        ? COLOR_FORMAT_RGBA8888
+                        : COLOR_FORMAT_RGB565,
+                    get_depth_format());
+                break;
+            }
+            if (sym == SDLK_F2) {
+                set_render_target_formats(
+                    get_color_format(),
+                    get_depth_format() == DEPTH_FORMAT_UNORM16
+                        ? DEPTH_FORMAT_FLOAT
+                        : DEPTH_FORMAT_UNORM16);
+                break;
+            }
+            if (sym == SDLK_F3) {
+                set_tiled_layout(!is_tiled_layout());
+                break;
+            }
+            if (sym == SDLK_F4) {
+                set_visibility_method((get_visibility_method() + 1) %
+                                      NUM_VISIBILITY_METHODS);
+                break;
+            }
+            if (sym == SDLK_F5) {
+                set_variable_rate_shading(!is_variable_rate_shading());
+                break;
+            }
+            if (sym == SDLK_F6) {
+                set_interlaced(!is_interlaced());
+                break;
+            }
+            if (sym == SDLK_F8) {
+                skip_unchanged_frames = !skip_unchanged_frames;
+                break;
+            }
+            if (sym == SDLK_9) {
+                use_bsp_order = !use_bsp_order;
+                set_depth_test(!use_bsp_order);
+                break;
+            }
             // Must input capital character to trigger these events, do not know
             // why
             if (sym == SDLK_w) {
@@ -137,6 +273,180 @@ void process_input(void) {
     }
 }
 
+vec4_t project_to_screen(vec4_t point) {
+    vec4_t projected = mat4_mul_vec4_project(proj_matrix, point);
+    // Scale into the view
+    projected.x *= (get_window_width() / 2.0);
+    projected.y *= (get_window_height() / 2.0);
+    // Invert the y values to account for flipped screen y coordinate, because
+    // y axis in model is heading up, but we render buffer from top to bottom
+    projected.y *= -1.0;
+    // Translate to center
+    projected.x += (get_window_width() / 2.0);
+    projected.y += (get_window_height() / 2.0);
+    return projected;
+}
+
+// Smallest rectangle holding both, empty ones have min_x >= max_x
+scissor_t union_rects(scissor_t a, scissor_t b) {
+    if (a.min_x >= a.max_x || a.min_y >= a.max_y) {
+        return b;
+    }
+    if (b.min_x >= b.max_x || b.min_y >= b.max_y) {
+        return a;
+    }
+    scissor_t rect = {a.min_x < b.min_x ? a.min_x : b.min_x,
+                      a.min_y < b.min_y ? a.min_y : b.min_y,
+                      a.max_x > b.max_x ? a.max_x : b.max_x,
+                      a.max_y > b.max_y ? a.max_y : b.max_y};
+    return rect;
+}
+
+// Returns whether anything of the triangle is left after culling and clipping
+bool process_triangle(vec3_t vertices[3], text2_t texcoords[3],
+                      uint32_t color, mesh_t *mesh) {
+    vec4_t transformed_vertices[3];
+    for (int j = 0; j < 3; j++) {
+        // To camera space
+        transformed_vertices[j] =
+            mat4_mul_vec4(view_matrix, vec4_from_vec3(vertices[j]));
+    }
+
+    // Back-face culling
+    vec3_t face_normal = get_triangle_normal(transformed_vertices);
+    if (should_cull_backface()) {
+        vec3_t origin = {0, 0, 0};
+        vec3_t camera_ray =
+            vec3_sub(origin, vec3_from_vec4(transformed_vertices[0]));
+        // Use dot product to calculate how aligned the camera ray is
+        // with the face normal
+        float dot_normal_camera = vec3_dot(face_normal, camera_ray);
+        // Bypass the triangles that are looking away from the camera
+        if (dot_normal_camera < 0) {
+            return false;
+        }
+    }
+
+    // Clipping
+    // Create a polygon from the original transformed triangle to be
+    // clipped
+    polygon_t polygon = create_polygon_from_triangle(
+        vec3_from_vec4(transformed_vertices[0]),
+        vec3_from_vec4(transformed_vertices[1]),
+        vec3_from_vec4(transformed_vertices[2]), texcoords[0], texcoords[1],
+        texcoords[2]);
+    // Clip the polygon and returns a new polygon with potential new
+    // vertices
+    clip_polygon(&polygon);
+    // Break the clipped polygon apart back into individual triangles
+    triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
+    int num_triangles_after_clipping = 0;
+    triangles_from_polygon(&polygon, triangles_after_clipping,
+                           &num_triangles_after_clipping);
+    // The mesh wireframe overlay only needs to know the face is visible
+    if (!should_render_filled_triangle() &&
+        !should_render_textured_triangle()) {
+        return num_triangles_after_clipping > 0;
+    }
+
+    // Loops all the assembled triangles after clipping
+    for (int t = 0; t < num_triangles_after_clipping; t++) {
+        triangle_t triangle_after_clipping = triangles_after_clipping[t];
+        // Points on screen also need to hold w to do depth
+        // interpolation and comparison. Holding z is not necessary.
+        vec4_t projected_points[3];
+        for (int j = 0; j < 3; j++) {
+            projected_points[j] =
+                project_to_screen(triangle_after_clipping.points[j]);
+        }
+        // Dense meshes have many triangles left without any pixel, drop them
+        // before they are queued, sorted and set up
+        if (!covers_any_pixel(projected_points)) {
+            continue;
+        }
+
+        // Color
+        float light_intensity_factor =
+            -vec3_dot(face_normal, get_light_direction());
+        uint32_t triangle_color =
+            light_apply_intensity(color, light_intensity_factor);
+
+        triangle_t triangle_to_render = {
+            .points = {{
+                           projected_points[0].x,
+                           projected_points[0].y,
+                           projected_points[0].z,
+                           projected_points[0].w,
+                       },
+                       {
+                           projected_points[1].x,
+                           projected_points[1].y,
+                           projected_points[1].z,
+                           projected_points[1].w,
+                       },
+                       {
+                           projected_points[2].x,
+                           projected_points[2].y,
+                           projected_points[2].z,
+                           projected_points[2].w,
+                       }},
+            .texcoords =
+                {
+                    {
+                        triangle_after_clipping.texcoords[0].u,
+                        triangle_after_clipping.texcoords[0].v,
+                    },
+
+                    {
+                        triangle_after_clipping.texcoords[1].u,
+                        triangle_after_clipping.texcoords[1].v,
+                    },
+
+                    {
+                        triangle_after_clipping.texcoords[2].u,
+                        triangle_after_clipping.texcoords[2].v,
+                    },
+                },
+            .color = triangle_color,
+            .texture = mesh->texture};
+        // Save
+        if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH) {
+            triangles_to_render[num_triangles_to_render] = triangle_to_render;
+            num_triangles_to_render++;
+            mesh->screen_bounds = union_rects(
+                mesh->screen_bounds, get_triangle_bounds(&triangle_to_render));
+        }
+    }
+    return num_triangles_after_clipping > 0;
+}
+
+void process_bsp_triangle(const bsp_triangle_t *triangle) {
+    vec3_t vertices[3] = {triangle->vertices[0], triangle->vertices[1],
+                          triangle->vertices[2]};
+    text2_t texcoords[3] = {triangle->texcoords[0], triangle->texcoords[1],
+                            triangle->texcoords[2]};
+    mesh_t *mesh = get_mesh(triangle->mesh_index);
+    if (process_triangle(vertices, texcoords, triangle->color, mesh) &&
+        should_render_mesh_wireframe()) {
+        mark_mesh_face_visible(mesh, triangle->face_index);
+    }
+}
+
+void update_mesh_transform(mesh_t *mesh) {
+    // mesh->rotation.x += 0.6f * delta_time;
+    // mesh->rotation.y += 0.9f * delta_time;
+    // mesh->rotation.z += 0.2f * delta_time;
+    // mesh->scale.x += 0.02f * delta_time;
+    // mesh->scale.y += 0.01f * delta_time;
+    // mesh->translation.x += 0.1f * delta_time;
+    mesh->translation.z = 5.0f;
+    // Only the first mesh spins, so the frame skip redraws just its screen
+    // bounds
+    if (animate_mesh && mesh == get_mesh(0)) {
+        mesh->rotation.y += 0.9f * delta_time;
+    }
+}
+
 // +-------------+
 // | Model space | <-- original mesh vertices
 // +-------------+
@@ -159,27 +469,7 @@ void process_input(void) {
 //                     `-> | Screen space | <-- ready to render
 //                         +--------------+
 void process_graphics_pipeline_stages(mesh_t *mesh) {
-    // mesh->rotation.x += 0.6f * delta_time;
-    // mesh->rotation.y += 0.9f * delta_time;
-    // mesh->rotation.z += 0.2f * delta_time;
-    // mesh->scale.x += 0.02f * delta_time;
-    // mesh->scale.y += 0.01f * delta_time;
-    // mesh->translation.x += 0.1f * delta_time;
-    mesh->translation.z = 5.0f;
-
-    // Create view matrix
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = {0, 1, 0};
-    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-    // Scale matrix
-    mat4_t scale_matrix =
-        mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(
-        mesh->translation.x, mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+    world_matrix = get_mesh_world_matrix(mesh);
 
     // Loop all faces
     int num_faces = array_length(mesh->faces);
@@ -191,135 +481,20 @@ void process_graphics_pipeline_stages(mesh_t *mesh) {
         face_vertices[1] = mesh->vertices[mesh_face.b];
         face_vertices[2] = mesh->vertices[mesh_face.c];
 
-        vec4_t transformed_vertices[3];
-
+        vec3_t world_vertices[3];
         for (int j = 0; j < 3; j++) {
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-            // Create a World Matrix combining scale, rotation and translation
-            // matrices
-            world_matrix = mat4_identity();
-            world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-            world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
             // World space
-            transformed_vertex =
-                mat4_mul_vec4(world_matrix, transformed_vertex);
-
-            // To camera space
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-            // Save transformed vertices
-            transformed_vertices[j] = transformed_vertex;
-        }
-
-        // Back-face culling
-        vec3_t face_normal = get_triangle_normal(transformed_vertices);
-        if (should_cull_backface()) {
-            vec3_t origin = {0, 0, 0};
-            vec3_t camera_ray =
-                vec3_sub(origin, vec3_from_vec4(transformed_vertices[0]));
-            // Use dot product to calculate how aligned the camera ray is
-            // with the face normal
-            float dot_normal_camera = vec3_dot(face_normal, camera_ray);
-            // Bypass the triangles that are looking away from the camera
-            if (dot_normal_camera < 0) {
-                continue;
-            }
+            vec4_t transformed_vertex =
+                mat4_mul_vec4(world_matrix, vec4_from_vec3(face_vertices[j]));
+            world_vertices[j] = vec3_from_vec4(transformed_vertex);
         }
 
-        // Clipping
-        // Create a polygon from the original transformed triangle to be
-        // clipped
-        polygon_t polygon = create_polygon_from_triangle(
-            vec3_from_vec4(transformed_vertices[0]),
-            vec3_from_vec4(transformed_vertices[1]),
-            vec3_from_vec4(transformed_vertices[2]), mesh_face.a_uv,
-            mesh_face.b_uv, mesh_face.c_uv);
-        // Clip the polygon and returns a new polygon with potential new
-        // vertices
-        clip_polygon(&polygon);
-        // Break the clipped polygon apart back into individual triangles
-        triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
-        int num_triangles_after_clipping = 0;
-        triangles_from_polygon(&polygon, triangles_after_clipping,
-                               &num_triangles_after_clipping);
-
-        // Loops all the assembled triangles after clipping
-        for (int t = 0; t < num_triangles_after_clipping; t++) {
-            triangle_t triangle_after_clipping = triangles_after_clipping[t];
-            // Points on screen also need to hold w to do depth
-            // interpolation and comparison. Holding z is not necessary.
-            vec4_t projected_points[3];
-            for (int j = 0; j < 3; j++) {
-                // Project the current vertex
-                projected_points[j] = mat4_mul_vec4_project(
-                    proj_matrix, triangle_after_clipping.points[j]);
-                // Scale into the view
-                projected_points[j].x *= (get_window_width() / 2.0);
-                projected_points[j].y *= (get_window_height() / 2.0);
-                // Invert the y values to account for flipped screen y
-                // coordinate, because y axis in model is heading up, but we
-                // render buffer from top to bottom
-                projected_points[j].y *= -1.0;
-                // Translate to center
-                projected_points[j].x += (get_window_width() / 2.0);
-                projected_points[j].y += (get_window_height() / 2.0);
-            }
-
-            // Color
-            float light_intensity_factor =
-                -vec3_dot(face_normal, get_light_direction());
-            uint32_t triangle_color =
-                light_apply_intensity(mesh_face.color, light_intensity_factor);
-
-            triangle_t triangle_to_render = {
-                .points = {{
-                               projected_points[0].x,
-                               projected_points[0].y,
-                               projected_points[0].z,
-                               projected_points[0].w,
-                           },
-                           {
-                               projected_points[1].x,
-                               projected_points[1].y,
-                               projected_points[1].z,
-                               projected_points[1].w,
-                           },
-                           {
-                               projected_points[2].x,
-                               projected_points[2].y,
-                               projected_points[2].z,
-                               projected_points[2].w,
-                           }},
-                .texcoords =
-                    {
-                        {
-                            triangle_after_clipping.texcoords[0].u,
-                            triangle_after_clipping.texcoords[0].v,
-                        },
-
-                        {
-                            triangle_after_clipping.texcoords[1].u,
-                            triangle_after_clipping.texcoords[1].v,
-                        },
-
-                        {
-                            triangle_after_clipping.texcoords[2].u,
-                            triangle_after_clipping.texcoords[2].v,
-                        },
-                    },
-                .color = triangle_color,
-                .texture = mesh->texture};
-            // Save
-            if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH) {
-                triangles_to_render[num_triangles_to_render] =
-                    triangle_to_render;
-                num_triangles_to_render++;
-            }
+        text2_t face_texcoords[3] = {mesh_face.a_uv, mesh_face.b_uv,
+                                     mesh_face.c_uv};
+        if (process_triangle(world_vertices, face_texcoords, mesh_face.color,
+                             mesh) &&
+            should_render_mesh_wireframe()) {
+            mark_mesh_face_visible(mesh, i);
         }
     }
 
@@ -341,83 +516,430 @@ void process_graphics_pipeline_stages(mesh_t *mesh) {
     } */
 }
 
+// Edges shared by several faces are drawn once, every vertex is transformed
+// once instead of once per face using it
+void process_mesh_wireframe(mesh_t *mesh) {
+    mat4_t world_view_matrix = mat4_mul_mat4(view_matrix,
+                                             get_mesh_world_matrix(mesh));
+    int num_vertices = array_length(mesh->vertices);
+    view_vertices =
+        (vec3_t *)realloc(view_vertices, sizeof(vec3_t) * num_vertices);
+    int num_used_vertices = array_length(mesh->used_vertices);
+    for (int i = 0; i < num_used_vertices; i++) {
+        int index = mesh->used_vertices[i];
+        if (mesh->visible_vertices[index]) {
+            view_vertices[index] = vec3_from_vec4(mat4_mul_vec4(
+                world_view_matrix, vec4_from_vec3(mesh->vertices[index])));
+        }
+    }
+
+    int num_edges = array_length(mesh->edges);
+    for (int i = 0; i < num_edges; i++) {
+        if (!mesh->visible_edges[i] ||
+            num_lines_to_render >= MAX_LINES_TO_RENDER) {
+            continue;
+        }
+        vec3_t a = view_vertices[mesh->edges[i].a];
+        vec3_t b = view_vertices[mesh->edges[i].b];
+        if (!clip_line(&a, &b)) {
+            continue;
+        }
+        vec4_t screen_a = project_to_screen(vec4_from_vec3(a));
+        vec4_t screen_b = project_to_screen(vec4_from_vec3(b));
+        line_t line = {screen_a.x, screen_a.y, screen_b.x, screen_b.y};
+        lines_to_render[num_lines_to_render++] = line;
+        scissor_t bounds = {line.x0 < line.x1 ? line.x0 : line.x1,
+                            line.y0 < line.y1 ? line.y0 : line.y1,
+                            (line.x0 > line.x1 ? line.x0 : line.x1) + 1,
+                            (line.y0 > line.y1 ? line.y0 : line.y1) + 1};
+        mesh->screen_bounds = union_rects(mesh->screen_bounds, bounds);
+    }
+
+    if (!should_render_wire_vertex()) {
+        return;
+    }
+    for (int i = 0; i < num_used_vertices; i++) {
+        int index = mesh->used_vertices[i];
+        if (!mesh->visible_vertices[index] ||
+            !is_point_inside_frustum(view_vertices[index]) ||
+            num_points_to_render >= MAX_POINTS_TO_RENDER) {
+            continue;
+        }
+        vec4_t screen =
+            project_to_screen(vec4_from_vec3(view_vertices[index]));
+        point_t point = {screen.x, screen.y};
+        points_to_render[num_points_to_render++] = point;
+        // Drawn as a 6x6 rectangle around the point
+        scissor_t bounds = {point.x - 3, point.y - 3, point.x + 3,
+                            point.y + 3};
+        mesh->screen_bounds = union_rects(mesh->screen_bounds, bounds);
+    }
+}
+
+// Counting sort of the render queue by coarse depth, near buckets first so the
+// z-buffer rejects more pixels, and by texture inside every bucket so
+// consecutive triangles sample the same texture
+void sort_triangles_to_render(void) {
+    if (num_triangles_to_render < 2) {
+        return;
+    }
+    float min_depth = triangles_to_render[0].points[0].w;
+    float max_depth = min_depth;
+    for (int i = 0; i < num_triangles_to_render; i++) {
+        for (int j = 0; j < 3; j++) {
+            float w = triangles_to_render[i].points[j].w;
+            min_depth = w < min_depth ? w : min_depth;
+            max_depth = w > max_depth ? w : max_depth;
+        }
+    }
+    float bucket_scale = NUM_DEPTH_BUCKETS / (max_depth - min_depth + 0.001f);
+
+    texture_t *textures[MAX_SORT_TEXTURES];
+    int num_textures = 0;
+    int counts[NUM_DEPTH_BUCKETS * MAX_SORT_TEXTURES] = {0};
+    for (int i = 0; i < num_triangles_to_render; i++) {
+        triangle_t *triangle = &triangles_to_render[i];
+        // Textures beyond the table all share the last slot
+        int texture_id = 0;
+        while (texture_id < num_textures &&
+               textures[texture_id] != triangle->texture) {
+            texture_id++;
+        }
+        if (texture_id == num_textures) {
+            if (num_textures < MAX_SORT_TEXTURES) {
+                textures[num_textures++] = triangle->texture;
+            } else {
+                texture_id = MAX_SORT_TEXTURES - 1;
+            }
+        }
+        float avg_depth = (triangle->points[0].w + triangle->points[1].w +
+                           triangle->points[2].w) /
+                          3.0f;
+        int bucket = (int)((avg_depth - min_depth) * bucket_scale);
+        sort_keys[i] = bucket * MAX_SORT_TEXTURES + texture_id;
+        counts[sort_keys[i]]++;
+    }
+
+    int offset = 0;
+    for (int i = 0; i < NUM_DEPTH_BUCKETS * MAX_SORT_TEXTURES; i++) {
+        int count = counts[i];
+        counts[i] = offset;
+        offset += count;
+    }
+    for (int i = 0; i < num_triangles_to_render; i++) {
+        sorted_triangles[counts[sort_keys[i]]++] = triangles_to_render[i];
+    }
+    memcpy(triangles_to_render, sorted_triangles,
+           sizeof(triangle_t) * num_triangles_to_render);
+}
+
+// Compares the scene about to be drawn with the last presented frame
+int plan_frame(void) {
+    int num_moved_meshes = 0;
+    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+        mesh_t *mesh = get_mesh(mesh_index);
+        mat4_t world_matrix = get_mesh_world_matrix(mesh);
+        if (memcmp(&world_matrix, &mesh->presented_world_matrix,
+                   sizeof(mat4_t)) != 0) {
+            moved_mesh = mesh;
+            num_moved_meshes++;
+        }
+    }
+    are_meshes_moved = num_moved_meshes > 0;
+    // Bounds left by an approximated frame are not exact either
+    if (!skip_unchanged_frames || needs_full_redraw ||
+        get_window_width() != presented_width ||
+        get_window_height() != presented_height ||
+        memcmp(&view_matrix, &presented_view_matrix, sizeof(mat4_t)) != 0 ||
+        num_moved_meshes > 1 ||
+        (num_moved_meshes == 1 && is_presented_frame_approximate)) {
+        return FRAME_FULL;
+    }
+    if (num_moved_meshes == 1) {
+        return FRAME_DIRTY_RECT;
+    }
+    return is_presented_frame_approximate ? FRAME_EXACT : FRAME_SKIPPED;
+}
+
 void update(void) {
     int time_to_wait =
         FRAME_TARGET_TIME - (SDL_GetTicks() - previous_frame_time);
-    if (0 < time_to_wait && time_to_wait <= FRAME_TARGET_TIME) {
+    if (limit_frame_rate && 0 < time_to_wait &&
+        time_to_wait <= FRAME_TARGET_TIME) {
         SDL_Delay(time_to_wait);
     }
     // Get a delta time factor counterted to senconds to be used to update our
     // game objects
     delta_time = (SDL_GetTicks() - previous_frame_time) / 1000.0f;
     previous_frame_time = SDL_GetTicks();
+    // Time spent waiting for the frame target is not part of the frame cost
+    frame_start_counter = SDL_GetPerformanceCounter();
 
     // Initialize the couter of triangles to render for current frame
     num_triangles_to_render = 0;
+    num_lines_to_render = 0;
+    num_points_to_render = 0;
 
-    // Loop all the meshes of our scene
+    // Create view matrix
+    vec3_t target = get_camera_lookat_target();
+    vec3_t up_direction = {0, 1, 0};
+    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
+
+    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+        update_mesh_transform(get_mesh(mesh_index));
+    }
+    frame_mode = plan_frame();
+    if (frame_mode == FRAME_SKIPPED) {
+        return;
+    }
     for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
         mesh_t *mesh = get_mesh(mesh_index);
-        // Process the graphics pipeline stages for every mesh of our 3D scene
-        process_graphics_pipeline_stages(mesh);
+        scissor_t empty = {0, 0, 0, 0};
+        mesh->screen_bounds = empty;
+        if (should_render_mesh_wireframe()) {
+            clear_mesh_visibility(mesh);
+        }
     }
-}
-
-void render(void) {
-    clear_color_buffer(0xFF000000);
-    clear_z_buffer();
-    draw_grid();
 
-    // Draw triangles on screen
-    for (int i = 0; i < num_triangles_to_render; i++) {
-        triangle_t triangle = triangles_to_render[i];
-        if (should_render_filled_triangle()) {
-            draw_filled_triangle(triangle.points[0].x, triangle.points[0].y,
-                                 triangle.points[0].z, triangle.points[0].w,
-                                 triangle.points[1].x, triangle.points[1].y,
-                                 triangle.points[1].z, triangle.points[1].w,
-                                 triangle.points[2].x, triangle.points[2].y,
-                                 triangle.points[2].z, triangle.points[2].w,
-                                 triangle.color);
+    if (use_bsp_order) {
+        // The static scene is split once, afterwards the tree gives the exact
+        // back to front order from any camera position, so the triangles can
+        // be painted without depth test
+        if (!is_bsp_tree_built()) {
+            build_bsp_tree();
         }
-        if (should_render_textured_triangle()) {
-            draw_textured_triangle(
-                triangle.points[0].x, triangle.points[0].y,
-                triangle.points[0].z, triangle.points[0].w,
-                triangle.texcoords[0].u, triangle.texcoords[0].v,
-                triangle.points[1].x, triangle.points[1].y,
-                triangle.points[1].z, triangle.points[1].w,
-                triangle.texcoords[1].u, triangle.texcoords[1].v,
-                triangle.points[2].x, triangle.points[2].y,
-                triangle.points[2].z, triangle.points[2].w,
-                triangle.texcoords[2].u, triangle.texcoords[2].v,
-                triangle.texture);
+        traverse_bsp_tree(get_camera_position(), process_bsp_triangle);
+    } else {
+        // Loop all the meshes of our scene
+        for (int mesh_index = 0; mesh_index < get_num_meshes();
+             mesh_index++) {
+            mesh_t *mesh = get_mesh(mesh_index);
+            // Process the graphics pipeline stages for every mesh of our 3D
+            // scene
+            process_graphics_pipeline_stages(mesh);
         }
-        if (should_render_wireframe()) {
-            draw_triangle(triangle.points[0].x, triangle.points[0].y,
-                          triangle.points[1].x, triangle.points[1].y,
-                          triangle.points[2].x, triangle.points[2].y,
-                          0xFF00FF00);
+        sort_triangles_to_render();
+    }
+
+    if (should_render_mesh_wireframe()) {
+        for (int mesh_index = 0; mesh_index < get_num_meshes();
+             mesh_index++) {
+            process_mesh_wireframe(get_mesh(mesh_index));
         }
-        if (should_render_wire_vertex()) {
-            // Draw vertices
-            for (int j = 0; j < 3; j++) {
-                draw_rect(triangle.points[j].x - 3, triangle.points[j].y - 3, 6,
-                          6, 0xFF0000FF);
+    }
+}
+
+// Pixel cost grows with the square of the scale, raising it by one step from
+// the lower threshold stays below the upper one, that gap and the waiting
+// period after every change keep the resolution from oscillating
+void update_render_scale(float frame_ms) {
+    average_frame_ms += (frame_ms - average_frame_ms) * 0.1f;
+    frames_since_scale_change++;
+    if (!dynamic_resolution ||
+        frames_since_scale_change < RENDER_SCALE_FRAMES) {
+        return;
+    }
+    float scale = get_render_scale();
+    if (average_frame_ms > 0.9f * FRAME_TARGET_TIME &&
+        scale > RENDER_SCALE_MIN) {
+        scale -= RENDER_SCALE_STEP;
+    } else if (average_frame_ms < 0.6f * FRAME_TARGET_TIME && scale < 1.0f) {
+        scale += RENDER_SCALE_STEP;
+    } else {
+        return;
+    }
+    set_render_scale(scale < RENDER_SCALE_MIN ? RENDER_SCALE_MIN : scale);
+    frames_since_scale_change = 0;
+}
+
+// Every rectangle is rasterized with the triangles overlapping it, in the
+// order of the render queue
+void draw_triangles_in_rects(const scissor_t *rects, int num_rects,
+                             const render_state_t *state) {
+    for (int i = 0; i < num_rects; i++) {
+        const scissor_t *rect = &rects[i];
+        int count = 0;
+        for (int j = 0; j < num_triangles_to_render; j++) {
+            scissor_t bounds = get_triangle_bounds(&triangles_to_render[j]);
+            if (bounds.min_x < rect->max_x && bounds.max_x > rect->min_x &&
+                bounds.min_y < rect->max_y && bounds.max_y > rect->min_y) {
+                sorted_triangles[count++] = triangles_to_render[j];
             }
         }
+        set_scissor(rect->min_x, rect->min_y, rect->max_x - rect->min_x,
+                    rect->max_y - rect->min_y);
+        draw_triangles(sorted_triangles, count, state);
+    }
+    reset_scissor();
+}
+
+// The presented frame stays on screen while nothing changes
+void record_presented_frame(bool is_approximate) {
+    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
+        mesh_t *mesh = get_mesh(mesh_index);
+        mesh->presented_world_matrix = get_mesh_world_matrix(mesh);
+        mesh->presented_bounds = mesh->screen_bounds;
+    }
+    presented_view_matrix = view_matrix;
+    presented_width = get_window_width();
+    presented_height = get_window_height();
+    is_presented_frame_approximate = is_approximate;
+    needs_full_redraw = false;
+}
+
+void render(void) {
+    if (frame_mode == FRAME_SKIPPED) {
+        return;
+    }
+    lock_color_buffer();
+    scissor_t dirty_rect = {0, 0, get_window_width(), get_window_height()};
+    if (frame_mode == FRAME_DIRTY_RECT) {
+        dirty_rect = union_rects(moved_mesh->presented_bounds,
+                                 moved_mesh->screen_bounds);
+    }
+    // The rest of the frame is kept from the presented one when it can be
+    // read back
+    bool is_rect_cleared =
+        frame_mode != FRAME_FULL && clear_buffers_rect(dirty_rect);
+    if (!is_rect_cleared) {
+        clear_buffers();
+    }
+
+    // Draw triangles on screen, the raster variant for the current render
+    // state is picked once for the whole queue
+    render_state_t render_state = get_render_state();
+    if (is_rect_cleared && frame_mode == FRAME_DIRTY_RECT) {
+        draw_triangles_in_rects(&dirty_rect, 1, &render_state);
+    } else {
+        draw_triangles(triangles_to_render, num_triangles_to_render,
+                       &render_state);
+    }
+    bool is_approximate = get_interlaced_field() >= 0;
+    // Interlaced frames rebuild the rows they skipped before the overlay,
+    // which is drawn on every row and over the whole frame, lines drawn
+    // again over themselves outside of a dirty rectangle change nothing
+    reconstruct_interlaced_rows();
+    for (int i = 0; i < num_lines_to_render; i++) {
+        line_t *line = &lines_to_render[i];
+        draw_line(line->x0, line->y0, line->x1, line->y1, WIRE_COLOR);
+    }
+    for (int i = 0; i < num_points_to_render; i++) {
+        draw_rect(points_to_render[i].x - 3, points_to_render[i].y - 3, 6, 6,
+                  VERTEX_COLOR);
     }
 
     render_color_buffer();
+    record_presented_frame(is_approximate);
+
+    float frame_ms = (SDL_GetPerformanceCounter() - frame_start_counter) *
+                     1000.0f / SDL_GetPerformanceFrequency();
+    update_render_scale(frame_ms);
 }
 
 void free_resources(void) {
+    free(view_vertices);
+    free_triangle_buffers();
+    free_bsp_tree();
     free_meshes();
     destroy_window();
 }
 
+// --headless WIDTHxHEIGHT renders offscreen without a window, --frames N
+// stops after N frames, --dump DIR writes every headless frame to DIR,
+// --rgb565 and --depth16 start with the 16-bit render target formats,
+// --tiled with the tiled render target layout, --span-buffer resolves
+// visibility with the span buffer instead of the depth buffer and
+// --depth-prepass with a depth pass before the shading pass, --vrs shades
+// magnified textures once for every 2x2 pixel block, --interlaced
+// rasterizes every other row and rebuilds the rest from the previous frame,
+// --skip-unchanged skips unchanged frames offscreen too, --async-present
+// uploads and presents frames on a thread of their own, otherwise frames
+// are rendered straight into the texture unless --no-zero-copy is given.
+// --render-method starts with one of wire, wire-vertex, fill, fill-wire,
+// textured and textured-wire instead of wire, --atlas packs the mesh
+// textures into one atlas at load time, --animate spins the first mesh.
+void parse_arguments(int argv, char **args) {
+    const char *render_methods[] = {
+        [RENDER_WIRE] = "wire",
+        [RENDER_WIRE_VERTEX] = "wire-vertex",
+        [RENDER_FILL_TRIANGLE] = "fill",
+        [RENDER_FILL_TRIANGLE_WIRE] = "fill-wire",
+        [RENDER_TEXTURED] = "textured",
+        [RENDER_TEXTURED_WIRE] = "textured-wire"};
+    int num_render_methods = sizeof(render_methods) / sizeof(render_methods[0]);
+    bool headless = false;
+    bool skip_unchanged = false;
+    int color_format = COLOR_FORMAT_RGBA8888;
+    int depth_format = DEPTH_FORMAT_FLOAT;
+    int width = 800;
+    int height = 600;
+    const char *dump_dir = NULL;
+    for (int i = 1; i < argv; i++) {
+        if (strcmp(args[i], "--headless") == 0 && i + 1 < argv) {
+            headless = sscanf(args[++i], "%dx%d", &width, &height) == 2 &&
+                       width > 0 && height > 0;
+        } else if (strcmp(args[i], "--render-method") == 0 && i + 1 < argv) {
+            const char *name = args[++i];
+            int method = 0;
+            while (method < num_render_methods &&
+                   strcmp(name, render_methods[method]) != 0) {
+                method++;
+            }
+            if (method < num_render_methods) {
+                initial_render_method = method;
+            } else {
+                fprintf(stderr, "Unknown render method %s.\n", name);
+            }
+        } else if (strcmp(args[i], "--frames") == 0 && i + 1 < argv) {
+            max_frames = atoi(args[++i]);
+        } else if (strcmp(args[i], "--dump") == 0 && i + 1 < argv) {
+            dump_dir = args[++i];
+        } else if (strcmp(args[i], "--rgb565") == 0) {
+            color_format = COLOR_FORMAT_RGB565;
+        } else if (strcmp(args[i], "--depth16") == 0) {
+            depth_format = DEPTH_FORMAT_UNORM16;
+        } else if (strcmp(args[i], "--tiled") == 0) {
+            set_tiled_layout(true);
+        } else if (strcmp(args[i], "--span-buffer") == 0) {
+            set_visibility_method(VISIBILITY_SPAN_BUFFER);
+        } else if (strcmp(args[i], "--depth-prepass") == 0) {
+            set_visibility_method(VISIBILITY_DEPTH_PREPASS);
+        } else if (strcmp(args[i], "--vrs") == 0) {
+            set_variable_rate_shading(true);
+        } else if (strcmp(args[i], "--interlaced") == 0) {
+            set_interlaced(true);
+        } else if (strcmp(args[i], "--skip-unchanged") == 0) {
+            skip_unchanged = true;
+        } else if (strcmp(args[i], "--atlas") == 0) {
+            use_texture_atlas = true;
+        } else if (strcmp(args[i], "--animate") == 0) {
+            animate_mesh = true;
+        } else if (strcmp(args[i], "--async-present") == 0) {
+            set_async_present(true);
+        } else if (strcmp(args[i], "--no-zero-copy") == 0) {
+            set_zero_copy_present(false);
+        } else {
+            fprintf(stderr, "Unknown argument %s.\n", args[i]);
+        }
+    }
+    set_render_target_formats(color_format, depth_format);
+    if (headless) {
+        set_offscreen_display(width, height, dump_dir);
+        // Benchmarks measure a fixed resolution and every frame
+        limit_frame_rate = false;
+        dynamic_resolution = false;
+        skip_unchanged_frames = skip_unchanged;
+    }
+}
+
 int main(int argv, char **args) {
+    parse_arguments(argv, args);
+
     is_running = initialize_window();
+    if (!is_running) {
+        destroy_window();
+        return 1;
+    }
 
     setup();
 
@@ -425,6 +947,10 @@ int main(int argv, char **args) {
         process_input();
         update();
         render();
+        num_frames++;
+        if (max_frames > 0 && num_frames >= max_frames) {
+            is_running = false;
+        }
     }
 
     free_resources();
@@ -2,6 +2,7 @@
 #include "array.h"
 #include "triangle.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define MAX_NUM_MESHES 10
@@ -14,6 +15,7 @@ void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
     mesh_t *mesh = &meshes[mesh_count];
     load_mesh_obj_data(mesh, obj_filename);
     load_mesh_png_data(mesh, png_filename);
+    build_mesh_topology(mesh);
     mesh->scale = scale;
     mesh->rotation = rotation;
     mesh->translation = translation;
@@ -62,24 +64,287 @@ void load_mesh_obj_data(mesh_t *mesh, char *obj_filename) {
 }
 
 void load_mesh_png_data(mesh_t *mesh, char *png_filename) {
-    upng_t *png_image = upng_new_from_file(png_filename);
-    if (png_image != NULL) {
-        upng_decode(png_image);
-        if (upng_get_error(png_image) == UPNG_EOK) {
-            mesh->texture = png_image;
+    mesh->texture = load_png_texture(png_filename);
+}
+
+typedef struct {
+    int a;
+    int b;
+    int face_edge; // face index * 3 + edge number inside the face
+} edge_key_t;
+
+static int compare_edge_keys(const void *left, const void *right) {
+    const edge_key_t *l = (const edge_key_t *)left;
+    const edge_key_t *r = (const edge_key_t *)right;
+    if (l->a != r->a) {
+        return l->a < r->a ? -1 : 1;
+    }
+    if (l->b != r->b) {
+        return l->b < r->b ? -1 : 1;
+    }
+    return 0;
+}
+
+// Sort the face edges by their vertex pair so edges shared by several faces
+// end up next to each other and become one entry of the edge list
+void build_mesh_topology(mesh_t *mesh) {
+    int num_faces = array_length(mesh->faces);
+    int num_vertices = array_length(mesh->vertices);
+    edge_key_t *keys = (edge_key_t *)malloc(sizeof(edge_key_t) * 3 * num_faces);
+    for (int i = 0; i < num_faces; i++) {
+        int indices[3] = {mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c};
+        for (int j = 0; j < 3; j++) {
+            int a = indices[j];
+            int b = indices[(j + 1) % 3];
+            edge_key_t key = {a < b ? a : b, a < b ? b : a, i * 3 + j};
+            keys[i * 3 + j] = key;
+        }
+    }
+    qsort(keys, 3 * num_faces, sizeof(edge_key_t), compare_edge_keys);
+
+    mesh->face_edges = (int *)malloc(sizeof(int) * 3 * num_faces);
+    for (int i = 0; i < 3 * num_faces; i++) {
+        if (i == 0 || compare_edge_keys(&keys[i - 1], &keys[i]) != 0) {
+            edge_t edge = {keys[i].a, keys[i].b};
+            array_push(mesh->edges, edge);
+        }
+        mesh->face_edges[keys[i].face_edge] = array_length(mesh->edges) - 1;
+    }
+    free(keys);
+
+    bool *is_used = (bool *)calloc(num_vertices, sizeof(bool));
+    for (int i = 0; i < num_faces; i++) {
+        is_used[mesh->faces[i].a] = true;
+        is_used[mesh->faces[i].b] = true;
+        is_used[mesh->faces[i].c] = true;
+    }
+    for (int i = 0; i < num_vertices; i++) {
+        if (is_used[i]) {
+            array_push(mesh->used_vertices, i);
+        }
+    }
+    free(is_used);
+
+    mesh->visible_edges =
+        (bool *)calloc(array_length(mesh->edges), sizeof(bool));
+    mesh->visible_vertices = (bool *)calloc(num_vertices, sizeof(bool));
+}
+
+void clear_mesh_visibility(mesh_t *mesh) {
+    memset(mesh->visible_edges, 0, sizeof(bool) * array_length(mesh->edges));
+    memset(mesh->visible_vertices, 0,
+           sizeof(bool) * array_length(mesh->vertices));
+}
+
+void mark_mesh_face_visible(mesh_t *mesh, int face_index) {
+    face_t *face = &mesh->faces[face_index];
+    for (int i = 0; i < 3; i++) {
+        mesh->visible_edges[mesh->face_edges[face_index * 3 + i]] = true;
+    }
+    mesh->visible_vertices[face->a] = true;
+    mesh->visible_vertices[face->b] = true;
+    mesh->visible_vertices[face->c] = true;
+}
+
+// Texels of border replicated around every packed texture, so interpolated UVs
+// that land right on the edge never read the neighbouring texture
+#define ATLAS_PADDING 2
+#define ATLAS_MAX_SIZE 4096
+
+typedef struct {
+    texture_t *texture;
+    int x;
+    int y;
+} atlas_slot_t;
+
+static int next_power_of_two(int n) {
+    int result = 1;
+    while (result < n) {
+        result <<= 1;
+    }
+    return result;
+}
+
+// The atlas can not repeat a texture, meshes with UVs outside [0, 1] keep
+// their own texture
+static bool can_pack_mesh(mesh_t *mesh) {
+    if (mesh->texture == NULL) {
+        return false;
+    }
+    int num_faces = array_length(mesh->faces);
+    for (int i = 0; i < num_faces; i++) {
+        text2_t uvs[3] = {mesh->faces[i].a_uv, mesh->faces[i].b_uv,
+                          mesh->faces[i].c_uv};
+        for (int j = 0; j < 3; j++) {
+            if (uvs[j].u < 0 || uvs[j].u > 1 || uvs[j].v < 0 || uvs[j].v > 1) {
+                return false;
+            }
         }
     }
+    return true;
+}
+
+// Shelf packing, slots are placed left to right in rows as tall as the
+// tallest texture, returns the used height
+static int place_atlas_slots(atlas_slot_t *slots, int num_slots,
+                             int atlas_width) {
+    int x = 0;
+    int y = 0;
+    int shelf_height = 0;
+    for (int i = 0; i < num_slots; i++) {
+        int width = slots[i].texture->width + 2 * ATLAS_PADDING;
+        int height = slots[i].texture->height + 2 * ATLAS_PADDING;
+        if (width > atlas_width) {
+            return ATLAS_MAX_SIZE + 1;
+        }
+        if (x + width > atlas_width) {
+            x = 0;
+            y += shelf_height;
+            shelf_height = 0;
+        }
+        slots[i].x = x + ATLAS_PADDING;
+        slots[i].y = y + ATLAS_PADDING;
+        x += width;
+        if (height > shelf_height) {
+            shelf_height = height;
+        }
+    }
+    return y + shelf_height;
+}
+
+static void copy_into_atlas(texture_t *atlas, atlas_slot_t *slot) {
+    texture_t *texture = slot->texture;
+    for (int y = -ATLAS_PADDING; y < texture->height + ATLAS_PADDING; y++) {
+        int src_y = y < 0 ? 0 : (y >= texture->height ? texture->height - 1 : y);
+        for (int x = -ATLAS_PADDING; x < texture->width + ATLAS_PADDING; x++) {
+            int src_x =
+                x < 0 ? 0 : (x >= texture->width ? texture->width - 1 : x);
+            atlas->buffer[(slot->y + y) * atlas->width + slot->x + x] =
+                texture->buffer[src_y * texture->width + src_x];
+        }
+    }
+}
+
+static text2_t remap_atlas_uv(text2_t uv, atlas_slot_t *slot,
+                              texture_t *atlas) {
+    // The rasterizer flips V before sampling, so the slot offset is applied
+    // to the flipped coordinate
+    text2_t result;
+    result.u = (slot->x + uv.u * slot->texture->width) / atlas->width;
+    result.v = 1.0f - (slot->y + (1.0f - uv.v) * slot->texture->height) /
+                          atlas->height;
+    return result;
+}
+
+// Merge the textures of all meshes into one atlas and remap the face UVs,
+// consecutive triangles of different meshes then share one texture working
+// set. Returns false if nothing was packed.
+bool pack_mesh_texture_atlas(void) {
+    atlas_slot_t slots[MAX_NUM_MESHES];
+    int num_slots = 0;
+    for (int i = 0; i < mesh_count; i++) {
+        if (can_pack_mesh(&meshes[i])) {
+            atlas_slot_t slot = {meshes[i].texture, 0, 0};
+            slots[num_slots++] = slot;
+        }
+    }
+    if (num_slots < 2) {
+        return false;
+    }
+
+    // Tallest first keeps the shelves tight
+    for (int i = 0; i < num_slots; i++) {
+        for (int j = i + 1; j < num_slots; j++) {
+            if (slots[j].texture->height > slots[i].texture->height) {
+                atlas_slot_t t = slots[i];
+                slots[i] = slots[j];
+                slots[j] = t;
+            }
+        }
+    }
+
+    // Smallest power of two width whose packing is not taller than wide
+    int atlas_width = 64;
+    int used_height = place_atlas_slots(slots, num_slots, atlas_width);
+    while (used_height > atlas_width && atlas_width < ATLAS_MAX_SIZE) {
+        atlas_width <<= 1;
+        used_height = place_atlas_slots(slots, num_slots, atlas_width);
+    }
+    if (used_height > ATLAS_MAX_SIZE) {
+        return false;
+    }
+
+    texture_t *atlas =
+        create_texture(atlas_width, next_power_of_two(used_height));
+    atlas->wrap_mode = TEXTURE_WRAP_CLAMP;
+    for (int i = 0; i < num_slots; i++) {
+        copy_into_atlas(atlas, &slots[i]);
+    }
+
+    for (int i = 0; i < mesh_count; i++) {
+        mesh_t *mesh = &meshes[i];
+        for (int j = 0; j < num_slots; j++) {
+            if (mesh->texture != slots[j].texture) {
+                continue;
+            }
+            int num_faces = array_length(mesh->faces);
+            for (int k = 0; k < num_faces; k++) {
+                face_t *face = &mesh->faces[k];
+                face->a_uv = remap_atlas_uv(face->a_uv, &slots[j], atlas);
+                face->b_uv = remap_atlas_uv(face->b_uv, &slots[j], atlas);
+                face->c_uv = remap_atlas_uv(face->c_uv, &slots[j], atlas);
+            }
+            mesh->texture = atlas;
+            break;
+        }
+    }
+    for (int i = 0; i < num_slots; i++) {
+        free_texture(slots[i].texture);
+    }
+    return true;
 }
 
 int get_num_meshes(void) { return mesh_count; }
 
 mesh_t *get_mesh(int index) { return &meshes[index]; }
 
+mat4_t get_mesh_world_matrix(mesh_t *mesh) {
+    mat4_t scale_matrix =
+        mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+    mat4_t translation_matrix = mat4_make_translation(
+        mesh->translation.x, mesh->translation.y, mesh->translation.z);
+    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
+    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
+    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+
+    // Create a World Matrix combining scale, rotation and translation
+    // matrices
+    mat4_t world_matrix = mat4_identity();
+    world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+    world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+    return world_matrix;
+}
+
 void free_meshes(void) {
     for (int i = 0; i < mesh_count; i++) {
         mesh_t *mesh = &meshes[i];
-        upng_free(mesh->texture);
+        // Meshes packed into an atlas share the same texture
+        bool is_shared = false;
+        for (int j = 0; j < i; j++) {
+            is_shared |= meshes[j].texture == mesh->texture;
+        }
+        if (!is_shared) {
+            free_texture(mesh->texture);
+        }
         array_free(mesh->faces);
         array_free(mesh->vertices);
+        array_free(mesh->edges);
+        array_free(mesh->used_vertices);
+        free(mesh->face_edges);
+        free(mesh->visible_edges);
+        free(mesh->visible_vertices);
     }
 }
@@ -1,15 +1,37 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include "matrix.h"
+#include "texture.h"
 #include "triangle.h"
-#include "upng.h"
 #include "vector.h"
+#include <stdbool.h>
+
+typedef struct {
+    int a;
+    int b;
+} edge_t;
 
 // Dynamic size mesh
 typedef struct {
     vec3_t *vertices;
     face_t *faces;
-    upng_t *texture;
+    // Topology built at load time, every edge and vertex shared by several
+    // faces is listed once
+    edge_t *edges;
+    int *face_edges;    // 3 edge indices per face
+    int *used_vertices; // indices of the vertices referenced by faces
+    // Per frame overlay state, flags are set for the edges and vertices of
+    // faces that survived culling and clipping
+    bool *visible_edges;
+    bool *visible_vertices;
+    // Screen rectangle holding everything drawn for the mesh in the frame
+    // being built and in the last presented one, which was drawn with
+    // presented_world_matrix
+    scissor_t screen_bounds;
+    scissor_t presented_bounds;
+    mat4_t presented_world_matrix;
+    texture_t *texture;
     vec3_t rotation; // rotation with x, y and z values
     vec3_t scale;
     vec3_t translation;
@@ -19,9 +41,15 @@ void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
                vec3_t rotation, vec3_t translation);
 void load_mesh_obj_data(mesh_t *mesh, char *obj_filename);
 void load_mesh_png_data(mesh_t *mesh, char *png_filename);
+void build_mesh_topology(mesh_t *mesh);
+bool pack_mesh_texture_atlas(void);
 
 int get_num_meshes(void);
 mesh_t *get_mesh(int index);
+mat4_t get_mesh_world_matrix(mesh_t *mesh);
+
+void clear_mesh_visibility(mesh_t *mesh);
+void mark_mesh_face_visible(mesh_t *mesh, int face_index);
 
 void free_meshes(void);
 
@@ -0,0 +1,179 @@
+#include "span_buffer.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Spans of all rows come from one pool that is emptied every frame, they are
+// linked by index so growing the pool does not invalidate the lists
+static span_t *spans = NULL;
+static int num_spans = 0;
+static int max_spans = 0;
+static int *row_heads = NULL;
+static int num_rows = 0;
+static int max_rows = 0;
+
+void clear_span_buffer(int rows) {
+    if (rows > max_rows) {
+        row_heads = (int *)realloc(row_heads, sizeof(int) * rows);
+        max_rows = rows;
+    }
+    for (int y = 0; y < rows; y++) {
+        row_heads[y] = -1;
+    }
+    num_rows = rows;
+    num_spans = 0;
+}
+
+static int get_next_span(int y, int previous) {
+    return previous < 0 ? row_heads[y] : spans[previous].next;
+}
+
+static void set_next_span(int y, int previous, int next) {
+    if (previous < 0) {
+        row_heads[y] = next;
+    } else {
+        spans[previous].next = next;
+    }
+}
+
+// Links a span after previous and returns its index, a span continuing
+// previous with the same id extends it instead
+static int append_span(int y, int previous, int x_start, int x_end,
+                       float depth, float depth_dx, int id) {
+    if (previous >= 0 && spans[previous].id == id &&
+        spans[previous].x_end + 1 == x_start) {
+        spans[previous].x_end = x_end;
+        return previous;
+    }
+    if (num_spans == max_spans) {
+        max_spans = max_spans > 0 ? 2 * max_spans : 4096;
+        spans = (span_t *)realloc(spans, sizeof(span_t) * max_spans);
+    }
+    span_t *span = &spans[num_spans];
+    span->x_start = x_start;
+    span->x_end = x_end;
+    span->depth = depth;
+    span->depth_dx = depth_dx;
+    span->id = id;
+    span->next = get_next_span(y, previous);
+    set_next_span(y, previous, num_spans);
+    return num_spans++;
+}
+
+// How much closer the new span is than the old one at pixel x
+static float depth_difference(const span_t *old, float depth, float depth_dx,
+                              int x) {
+    return (depth - old->depth) + (depth_dx - old->depth_dx) * x;
+}
+
+// The difference of two depth planes is linear along the row, so the pixels
+// of an overlap where the new span is closer form a single range at one end.
+// Like the less depth test, ties keep the old span. Returns false if the new
+// span is hidden on the whole overlap.
+static bool find_closer_range(const span_t *old, float depth, float depth_dx,
+                              int x_start, int x_end, int *closer_start,
+                              int *closer_end) {
+    float d0 = depth_difference(old, depth, depth_dx, x_start);
+    float d1 = depth_difference(old, depth, depth_dx, x_end);
+    if (d0 <= 0 && d1 <= 0) {
+        return false;
+    }
+    if (d0 > 0 && d1 > 0) {
+        *closer_start = x_start;
+        *closer_end = x_end;
+        return true;
+    }
+    // The signs differ, so the overlap is at least two pixels wide, the
+    // estimate from the crossing point is fixed up pixel by pixel
+    int x = x_start + (int)(d0 / (d0 - d1) * (x_end - x_start));
+    x = x < x_start ? x_start : (x > x_end ? x_end : x);
+    if (d0 > 0) {
+        // Last pixel where the new span is closer
+        while (x > x_start &&
+               depth_difference(old, depth, depth_dx, x) <= 0) {
+            x--;
+        }
+        while (x < x_end &&
+               depth_difference(old, depth, depth_dx, x + 1) > 0) {
+            x++;
+        }
+        *closer_start = x_start;
+        *closer_end = x;
+    } else {
+        // First pixel where the new span is closer
+        while (x < x_end && depth_difference(old, depth, depth_dx, x) <= 0) {
+            x++;
+        }
+        while (x > x_start &&
+               depth_difference(old, depth, depth_dx, x - 1) > 0) {
+            x--;
+        }
+        *closer_start = x;
+        *closer_end = x_end;
+    }
+    return true;
+}
+
+// Gaps of the row covered by the span take it as it is, spans it overlaps are
+// split where it comes in front of them
+void insert_span(int y, int x_start, int x_end, float depth, float depth_dx,
+                 int id) {
+    int previous = -1;
+    int x = x_start;
+    while (x <= x_end) {
+        int current = get_next_span(y, previous);
+        if (current >= 0 && spans[current].x_end < x) {
+            previous = current;
+            continue;
+        }
+        if (current < 0 || spans[current].x_start > x_end) {
+            append_span(y, previous, x, x_end, depth, depth_dx, id);
+            return;
+        }
+        if (spans[current].x_start > x) {
+            previous = append_span(y, previous, x, spans[current].x_start - 1,
+                                   depth, depth_dx, id);
+            x = spans[current].x_start;
+            continue;
+        }
+
+        span_t old = spans[current];
+        int overlap_end = old.x_end < x_end ? old.x_end : x_end;
+        int closer_start, closer_end;
+        if (!find_closer_range(&old, depth, depth_dx, x, overlap_end,
+                               &closer_start, &closer_end)) {
+            previous = current;
+            x = overlap_end + 1;
+            continue;
+        }
+        // Relink the old span as the pieces left and right of the closer
+        // range, its node stays unused until the buffer is cleared
+        set_next_span(y, previous, old.next);
+        if (old.x_start < closer_start) {
+            previous = append_span(y, previous, old.x_start, closer_start - 1,
+                                   old.depth, old.depth_dx, old.id);
+        }
+        previous = append_span(y, previous, closer_start, closer_end, depth,
+                               depth_dx, id);
+        if (closer_end < old.x_end) {
+            previous = append_span(y, previous, closer_end + 1, old.x_end,
+                                   old.depth, old.depth_dx, old.id);
+        }
+        x = overlap_end + 1;
+    }
+}
+
+int get_first_span(int y) { return y < num_rows ? row_heads[y] : -1; }
+
+// Only valid until the next insert_span, which may grow the pool
+const span_t *get_spans(void) { return spans; }
+
+void free_span_buffer(void) {
+    free(spans);
+    free(row_heads);
+    spans = NULL;
+    row_heads = NULL;
+    num_spans = 0;
+    max_spans = 0;
+    num_rows = 0;
+    max_rows = 0;
+}
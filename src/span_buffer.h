@@ -0,0 +1,26 @@
+#ifndef SPAN_BUFFER_H
+#define SPAN_BUFFER_H
+
+// Every row of the span buffer is a list of non-overlapping spans sorted by x,
+// a span keeps the depth plane of the primitive it shows along the row, so
+// inserting a span resolves its visibility against the spans already there
+typedef struct {
+    int x_start;
+    int x_end;
+    // Depth at x = 0 of the row and its step per pixel, greater is closer to
+    // the camera like 1/w
+    float depth;
+    float depth_dx;
+    int id;
+    // Index of the next span of the row, -1 at the end
+    int next;
+} span_t;
+
+void clear_span_buffer(int num_rows);
+void insert_span(int y, int x_start, int x_end, float depth, float depth_dx,
+                 int id);
+int get_first_span(int y);
+const span_t *get_spans(void);
+void free_span_buffer(void);
+
+#endif
@@ -1,6 +1,48 @@
 #include "texture.h"
+#include "upng.h"
+#include <stdlib.h>
+#include <string.h>
 
 text2_t tex2_clone(text2_t *t) {
     text2_t result = {t->u, t->v};
     return result;
 }
+
+texture_t *create_texture(int width, int height) {
+    texture_t *texture = (texture_t *)malloc(sizeof(texture_t));
+    texture->width = width;
+    texture->height = height;
+    texture->wrap_mode = TEXTURE_WRAP_REPEAT;
+    texture->buffer = (uint32_t *)calloc(width * height, sizeof(uint32_t));
+    return texture;
+}
+
+texture_t *load_png_texture(char *png_filename) {
+    upng_t *png_image = upng_new_from_file(png_filename);
+    if (png_image == NULL) {
+        return NULL;
+    }
+    texture_t *texture = NULL;
+    upng_decode(png_image);
+    if (upng_get_error(png_image) == UPNG_EOK &&
+        upng_get_format(png_image) == UPNG_RGBA8) {
+        texture = create_texture(upng_get_width(png_image),
+                                 upng_get_height(png_image));
+        memcpy(texture->buffer, upng_get_buffer(png_image),
+               sizeof(uint32_t) * texture->width * texture->height);
+    }
+    upng_free(png_image);
+    return texture;
+}
+
+void free_texture(texture_t *texture) {
+    if (texture != NULL) {
+        free(texture->buffer);
+        free(texture);
+    }
+}
+
+bool is_texture_power_of_two(const texture_t *texture) {
+    return (texture->width & (texture->width - 1)) == 0 &&
+           (texture->height & (texture->height - 1)) == 0;
+}
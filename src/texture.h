@@ -1,11 +1,30 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct {
     float u;
     float v;
 } text2_t;
 
+enum { TEXTURE_WRAP_REPEAT, TEXTURE_WRAP_CLAMP };
+
+// Decoded RGBA32 texture, meshes whose textures were packed into an atlas
+// all point at the texture_t of the atlas
+typedef struct {
+    int width;
+    int height;
+    int wrap_mode;
+    uint32_t *buffer;
+} texture_t;
+
 text2_t tex2_clone(text2_t *t);
 
+texture_t *create_texture(int width, int height);
+texture_t *load_png_texture(char *png_filename);
+void free_texture(texture_t *texture);
+bool is_texture_power_of_two(const texture_t *texture);
+
 #endif
@@ -1,7 +1,11 @@
 #include "triangle.h"
 #include "display.h"
+#include "span_buffer.h"
 #include "swap.h"
 #include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 vec3_t get_triangle_normal(vec4_t vertices[3]) {
     vec3_t vector_a = vec3_from_vec4(vertices[0]);
@@ -18,18 +22,28 @@ vec3_t get_triangle_normal(vec4_t vertices[3]) {
     return normal;
 }
 
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
-    vec2_t ap = vec2_sub(p, a);
-    float area_parallelogram_abc = ac.x * ab.y - ac.y * ab.x;
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
-    float gamma = 1.0f - alpha - beta;
-    vec3_t weights = {alpha, beta, gamma};
-    return weights;
+// The rasterizer truncates the vertices to whole pixels, a triangle whose
+// truncated vertices are collinear covers no pixel at all, whether it is
+// degenerate or just smaller than a pixel
+bool covers_any_pixel(const vec4_t points[3]) {
+    int x0 = points[0].x, y0 = points[0].y;
+    int x1 = points[1].x, y1 = points[1].y;
+    int x2 = points[2].x, y2 = points[2].y;
+    return (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0) != 0;
+}
+
+// Pixels the rasterizer may touch for the truncated vertices, max_x and max_y
+// are exclusive like the ones of the scissor rectangle. Span ends are stepped
+// along the edges in floats and may round one pixel past a vertex in x.
+scissor_t get_triangle_bounds(const triangle_t *triangle) {
+    const vec4_t *points = triangle->points;
+    float min_x = fminf(points[0].x, fminf(points[1].x, points[2].x));
+    float min_y = fminf(points[0].y, fminf(points[1].y, points[2].y));
+    float max_x = fmaxf(points[0].x, fmaxf(points[1].x, points[2].x));
+    float max_y = fmaxf(points[0].y, fmaxf(points[1].y, points[2].y));
+    scissor_t bounds = {(int)min_x - 1, (int)min_y, (int)max_x + 2,
+                        (int)max_y + 1};
+    return bounds;
 }
 
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
@@ -69,250 +83,1035 @@ void fill_flat_top_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
     }
 }
 
-void draw_triangle_pixel(int x, int y, uint32_t color, vec4_t point_a,
-                         vec4_t point_b, vec4_t point_c) {
-    vec2_t point_p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-    vec3_t weights = barycentric_weights(a, b, c, point_p);
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
-    float interpolated_reciprocal_w = (1 / point_a.w) * alpha +
-                                      (1 / point_b.w) * beta +
-                                      (1 / point_c.w) * gamma;
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-        draw_pixel(x, y, color);
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+// Pixels closer than this to an edge, measured along the minor axis of the
+// edge like a DDA line, get the wire color. Both triangles sharing an edge
+// draw their half, together about one pixel wide.
+#define WIRE_WIDTH 0.5f
+
+// The raster functions below take these as compile-time constants, every
+// combination is instantiated by DEFINE_TRIANGLE_BATCH and the branches on
+// them fold away in the inlined pixel loop
+enum { SHADE_FILL, SHADE_TEXTURE, SHADE_DEPTH_ONLY };
+// The equal tests shade the fragments left in the depth buffer by a depth
+// pass and do not write depth
+enum {
+    DEPTH_TEST_OFF,
+    DEPTH_TEST_LESS,
+    DEPTH_TEST_LESS_UNORM16,
+    DEPTH_TEST_EQUAL,
+    DEPTH_TEST_EQUAL_UNORM16
+};
+enum { OVERLAY_NONE, OVERLAY_WIRE };
+enum { WRAP_REPEAT, WRAP_REPEAT_POW2, WRAP_CLAMP };
+
+// Screen space plane equations of the attributes, 1/w, u/w and v/w are linear
+// in screen space so they can be stepped per pixel instead of computing
+// barycentric weights for every pixel
+typedef struct {
+    int x0;
+    int y0;
+    float reciprocal_w, reciprocal_w_dx, reciprocal_w_dy;
+    float u_over_w, u_over_w_dx, u_over_w_dy;
+    float v_over_w, v_over_w_dx, v_over_w_dy;
+    // Distance to the edge opposite to every vertex
+    float edge[3], edge_dx[3], edge_dy[3];
+    uint32_t color;
+    const texture_t *texture;
+    // 65535 * znear, 16-bit depth is 65535 - depth_scale / w
+    float depth_scale;
+    // Textured triangles with coarse shading sample the texture once for
+    // every 2x2 pixel block, serial tells their blocks apart in the cache
+    bool coarse_shading;
+    uint32_t serial;
+} triangle_setup_t;
+
+static FORCE_INLINE void setup_gradient(float a0, float a1, float a2,
+                                        float dx1, float dy1, float dx2,
+                                        float dy2, float inv_area, float *dadx,
+                                        float *dady) {
+    *dadx = ((a1 - a0) * dy2 - (a2 - a0) * dy1) * inv_area;
+    *dady = ((a2 - a0) * dx1 - (a1 - a0) * dx2) * inv_area;
+}
+
+static FORCE_INLINE int wrap_texel(float coordinate, int size, int wrap) {
+    int texel = (int)(coordinate * size);
+    if (wrap == WRAP_CLAMP) {
+        return texel < 0 ? 0 : (texel >= size ? size - 1 : texel);
     }
+    // x and y are integers, maybe outside of the triangle in math, so wrap to
+    // prevent texture buffer overflow
+    if (wrap == WRAP_REPEAT_POW2) {
+        return abs(texel) & (size - 1);
+    }
+    return abs(texel) % size;
 }
 
-void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1,
-                          float z1, float w1, int x2, int y2, float z2,
-                          float w2, uint32_t color) {
-    // Sort to make y0 < y1 < y2
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-    }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
-
-    // Flat bottom
-    float inv_slope1 = 0;
-    float inv_slope2 = 0;
-    if (y1 - y0 != 0) {
-        inv_slope1 = (float)(x1 - x0) / abs(y1 - y0);
+// Attributes at the current pixel of a span
+typedef struct {
+    float reciprocal_w;
+    float u_over_w;
+    float v_over_w;
+    float edge[3];
+} span_attributes_t;
+
+static FORCE_INLINE void evaluate_attributes(const triangle_setup_t *setup,
+                                             int x, int y, int shade,
+                                             int overlay,
+                                             span_attributes_t *attributes) {
+    *attributes = (span_attributes_t){0};
+    float dx = x - setup->x0;
+    float dy = y - setup->y0;
+    attributes->reciprocal_w = setup->reciprocal_w +
+                               setup->reciprocal_w_dx * dx +
+                               setup->reciprocal_w_dy * dy;
+    if (shade == SHADE_TEXTURE) {
+        attributes->u_over_w = setup->u_over_w + setup->u_over_w_dx * dx +
+                               setup->u_over_w_dy * dy;
+        attributes->v_over_w = setup->v_over_w + setup->v_over_w_dx * dx +
+                               setup->v_over_w_dy * dy;
     }
-    if (y2 - y0 != 0) {
-        inv_slope2 = (float)(x2 - x0) / abs(y2 - y0);
+    if (overlay != OVERLAY_NONE) {
+        for (int i = 0; i < 3; i++) {
+            attributes->edge[i] = setup->edge[i] + setup->edge_dx[i] * dx +
+                                  setup->edge_dy[i] * dy;
+        }
     }
-    if (y1 - y0 != 0) {
-        for (int y = y0; y < y1; y++) {
-            int x_start = x1 + (y - y1) * inv_slope1;
-            int x_end = x0 + (y - y0) * inv_slope2;
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+}
+
+static FORCE_INLINE uint32_t sample_texture(const texture_t *texture,
+                                            float u_over_w, float v_over_w,
+                                            float reciprocal_w, int wrap) {
+    // Perspective correct interpolation
+    int tex_x = wrap_texel(u_over_w / reciprocal_w, texture->width, wrap);
+    int tex_y = wrap_texel(v_over_w / reciprocal_w, texture->height, wrap);
+    return texture->buffer[tex_y * texture->width + tex_x];
+}
+
+// Colors of the 2x2 blocks of one row of blocks, a block shaded on its even
+// row is reused on the odd one. Keys hold the triangle serial in the high
+// half and the block row in the low half.
+static uint32_t *coarse_colors = NULL;
+static uint64_t *coarse_keys = NULL;
+static int max_coarse_blocks = 0;
+static uint32_t next_serial = 0;
+
+// The texture is sampled at the first pixel of the block that is shaded,
+// the top left one unless the block is only partly covered, so the sample
+// never lies outside the triangle where a repeated texture would wrap to its
+// opposite edge. The other pixels of the block reuse that color whichever
+// row shades them.
+static FORCE_INLINE uint32_t shade_coarse(const triangle_setup_t *setup,
+                                          int x, int y, float reciprocal_w,
+                                          float u_over_w, float v_over_w,
+                                          int wrap) {
+    uint64_t key = (uint64_t)setup->serial << 32 | (uint32_t)(y >> 1);
+    int block = x >> 1;
+    if (coarse_keys[block] == key) {
+        return coarse_colors[block];
+    }
+    uint32_t color = sample_texture(setup->texture, u_over_w, v_over_w,
+                                    reciprocal_w, wrap);
+    coarse_keys[block] = key;
+    coarse_colors[block] = color;
+    return color;
+}
+
+// Shade count pixels contiguous in memory starting at x, y, the attributes
+// are stepped past the last one
+static FORCE_INLINE void rasterize_run(const triangle_setup_t *setup,
+                                       void *color_run, void *depth_run,
+                                       int x, int y, int count,
+                                       span_attributes_t *attributes,
+                                       int format, int shade, int depth,
+                                       int overlay, int wrap) {
+    float reciprocal_w = attributes->reciprocal_w;
+    float u_over_w = attributes->u_over_w;
+    float v_over_w = attributes->v_over_w;
+    float edge[3] = {attributes->edge[0], attributes->edge[1],
+                     attributes->edge[2]};
+    bool is_unorm16 = depth == DEPTH_TEST_LESS_UNORM16 ||
+                      depth == DEPTH_TEST_EQUAL_UNORM16;
+    bool is_equal_test =
+        depth == DEPTH_TEST_EQUAL || depth == DEPTH_TEST_EQUAL_UNORM16;
+    // Block of the last coarse sample, the pixel pairs of a block row are
+    // shaded without going through the cache
+    int coarse_block = -1;
+    uint32_t coarse_color = 0;
+    for (int offset = 0; offset < count; offset++) {
+        // Smaller w is, closer to screen the pixel is, greater 1/w is, so
+        // 1 - 1/w gives the pixels that are closer to the camera smaller
+        // values, less than the 1.0 the z-buffer is cleared to
+        float depth_value = 1.0f - reciprocal_w;
+        uint16_t depth_unorm = 0;
+        bool is_visible = true;
+        if (depth != DEPTH_TEST_OFF && is_unorm16) {
+            // Pixels are clipped against znear, so 1/w is at most 1/znear
+            float unorm = 65535.0f - setup->depth_scale * reciprocal_w;
+            depth_unorm = (uint16_t)(unorm > 0.0f ? unorm : 0.0f);
+            uint16_t stored = ((uint16_t *)depth_run)[offset];
+            is_visible = is_equal_test ? depth_unorm == stored
+                                       : depth_unorm < stored;
+        } else if (depth != DEPTH_TEST_OFF) {
+            float stored = ((float *)depth_run)[offset];
+            is_visible = is_equal_test ? depth_value == stored
+                                       : depth_value < stored;
+        }
+        if (is_visible && shade != SHADE_DEPTH_ONLY) {
+            uint32_t color = setup->color;
+            bool is_edge = false;
+            if (overlay != OVERLAY_NONE) {
+                // The wireframe is drawn in the same pass, so it is hidden
+                // by closer triangles like the fill
+                is_edge = edge[0] < WIRE_WIDTH || edge[1] < WIRE_WIDTH ||
+                          edge[2] < WIRE_WIDTH;
+            }
+            if (is_edge) {
+                color = WIRE_COLOR;
+            } else if (shade == SHADE_TEXTURE && setup->coarse_shading) {
+                if ((x + offset) >> 1 != coarse_block) {
+                    coarse_block = (x + offset) >> 1;
+                    coarse_color = shade_coarse(setup, x + offset, y,
+                                                reciprocal_w, u_over_w,
+                                                v_over_w, wrap);
+                }
+                color = coarse_color;
+            } else if (shade == SHADE_TEXTURE) {
+                color = sample_texture(setup->texture, u_over_w, v_over_w,
+                                       reciprocal_w, wrap);
             }
-            for (int x = x_start; x <= x_end; x++) {
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+            if (format == COLOR_FORMAT_RGB565) {
+                ((uint16_t *)color_run)[offset] = pack_rgb565(color);
+            } else {
+                ((uint32_t *)color_run)[offset] = color;
+            }
+        }
+        if (is_visible) {
+            if (depth == DEPTH_TEST_LESS) {
+                ((float *)depth_run)[offset] = depth_value;
+            } else if (depth == DEPTH_TEST_LESS_UNORM16) {
+                ((uint16_t *)depth_run)[offset] = depth_unorm;
+            }
+        }
+        reciprocal_w += setup->reciprocal_w_dx;
+        if (shade == SHADE_TEXTURE) {
+            u_over_w += setup->u_over_w_dx;
+            v_over_w += setup->v_over_w_dx;
+        }
+        if (overlay != OVERLAY_NONE) {
+            for (int i = 0; i < 3; i++) {
+                edge[i] += setup->edge_dx[i];
             }
         }
     }
+    attributes->reciprocal_w = reciprocal_w;
+    attributes->u_over_w = u_over_w;
+    attributes->v_over_w = v_over_w;
+    for (int i = 0; i < 3; i++) {
+        attributes->edge[i] = edge[i];
+    }
+}
 
-    // Flat top
-    inv_slope1 = 0;
-    inv_slope2 = 0;
-    if (y2 - y1 != 0) {
-        inv_slope1 = (float)(x2 - x1) / abs(y2 - y1);
+static FORCE_INLINE void rasterize_span(const triangle_setup_t *setup,
+                                        const scissor_t *scissor, int y,
+                                        int x_start, int x_end, int format,
+                                        int shade, int depth, int overlay,
+                                        int wrap) {
+    // Clip the span once, the pixel loop below accesses the buffers unchecked
+    x_start = x_start > scissor->min_x ? x_start : scissor->min_x;
+    x_end = x_end < scissor->max_x - 1 ? x_end : scissor->max_x - 1;
+    if (x_start > x_end) {
+        return;
     }
-    if (y2 - y0 != 0) {
-        inv_slope2 = (float)(x2 - x0) / abs(y2 - y0);
+    if (depth != DEPTH_TEST_OFF) {
+        prepare_zbuffer_span(y, x_start, x_end);
     }
-    if (y2 - y1 != 0) {
-        for (int y = y1; y <= y2; y++) {
-            int x_start = x1 + (y - y1) * inv_slope1;
-            int x_end = x0 + (y - y0) * inv_slope2;
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+    span_attributes_t attributes;
+    evaluate_attributes(setup, x_start, y, shade, overlay, &attributes);
+    for (int run_start = x_start; run_start <= x_end;) {
+        // Pixels are indexed directly within a run of contiguous memory, the
+        // whole span unless the buffers are tiled
+        int run_end = get_contiguous_end(run_start, x_end);
+        void *color_run = get_color_pixel(run_start, y);
+        void *depth_run =
+            depth != DEPTH_TEST_OFF ? get_zbuffer_pixel(run_start, y) : NULL;
+        rasterize_run(setup, color_run, depth_run, run_start, y,
+                      run_end - run_start + 1, &attributes, format, shade,
+                      depth, overlay, wrap);
+        run_start = run_end + 1;
+    }
+}
+
+#define SETUP_BATCH_SIZE 8
+
+// Triangle setup of SETUP_BATCH_SIZE triangles as structure of arrays, the
+// loops over the lanes have no branches and are vectorized by the compiler.
+// Vertices of every lane are sorted by y.
+typedef struct {
+    int x[3][SETUP_BATCH_SIZE];
+    int y[3][SETUP_BATCH_SIZE];
+    float reciprocal_w[3][SETUP_BATCH_SIZE];
+    float u_over_w[3][SETUP_BATCH_SIZE];
+    float v_over_w[3][SETUP_BATCH_SIZE];
+    int area[SETUP_BATCH_SIZE];
+    float reciprocal_w_dx[SETUP_BATCH_SIZE];
+    float reciprocal_w_dy[SETUP_BATCH_SIZE];
+    float u_over_w_dx[SETUP_BATCH_SIZE];
+    float u_over_w_dy[SETUP_BATCH_SIZE];
+    float v_over_w_dx[SETUP_BATCH_SIZE];
+    float v_over_w_dy[SETUP_BATCH_SIZE];
+    float edge_dx[3][SETUP_BATCH_SIZE];
+    float edge_dy[3][SETUP_BATCH_SIZE];
+    float edge_scale[3][SETUP_BATCH_SIZE];
+} setup_batch_t;
+
+static FORCE_INLINE void load_setup_batch(setup_batch_t *batch,
+                                          const triangle_t *triangles,
+                                          int count, int shade) {
+    for (int lane = 0; lane < SETUP_BATCH_SIZE; lane++) {
+        if (lane >= count) {
+            // Unused lanes get a zero area and are skipped
+            for (int i = 0; i < 3; i++) {
+                batch->x[i][lane] = 0;
+                batch->y[i][lane] = 0;
+                batch->reciprocal_w[i][lane] = 0;
+                batch->u_over_w[i][lane] = 0;
+                batch->v_over_w[i][lane] = 0;
             }
-            for (int x = x_start; x <= x_end; x++) {
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+            continue;
+        }
+        const triangle_t *triangle = &triangles[lane];
+        // Sort to make y0 < y1 < y2, vertices are truncated to integer pixel
+        // positions
+        int order[3] = {0, 1, 2};
+        if ((int)triangle->points[order[0]].y >
+            (int)triangle->points[order[1]].y) {
+            int_swap(&order[0], &order[1]);
+        }
+        if ((int)triangle->points[order[1]].y >
+            (int)triangle->points[order[2]].y) {
+            int_swap(&order[1], &order[2]);
+        }
+        if ((int)triangle->points[order[0]].y >
+            (int)triangle->points[order[1]].y) {
+            int_swap(&order[0], &order[1]);
+        }
+        for (int i = 0; i < 3; i++) {
+            const vec4_t *point = &triangle->points[order[i]];
+            float reciprocal_w = 1.0f / point->w;
+            batch->x[i][lane] = point->x;
+            batch->y[i][lane] = point->y;
+            batch->reciprocal_w[i][lane] = reciprocal_w;
+            if (shade == SHADE_TEXTURE) {
+                const text2_t *uv = &triangle->texcoords[order[i]];
+                batch->u_over_w[i][lane] = uv->u * reciprocal_w;
+                // Flip the V component to account for inverted
+                // UV-coordinates (V grows downwards)
+                batch->v_over_w[i][lane] = (1.0f - uv->v) * reciprocal_w;
             }
         }
     }
 }
 
-void draw_triangle_texel(int x, int y, upng_t *texture, vec4_t point_a,
-                         vec4_t point_b, vec4_t point_c, text2_t a_uv,
-                         text2_t b_uv, text2_t c_uv) {
-    vec2_t point_p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-
-    vec3_t weights = barycentric_weights(a, b, c, point_p);
-
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
-
-    // Affine texture mapping, has distortion problem
-    // float interpolated_u = u0 * alpha + u1 * beta + u2 * gamma;
-    // float interpolated_v = v0 * alpha + v1 * beta + v2 * gamma;
-
-    // Perspective-Correct Texture Mapping
-    float interpolated_u;
-    float interpolated_v;
-    // 1/w is linear, can be interpolated
-    float interpolated_reciprocal_w;
-
-    interpolated_u = (a_uv.u / point_a.w) * alpha +
-                     (b_uv.u / point_b.w) * beta + (c_uv.u / point_c.w) * gamma;
-    interpolated_v = (a_uv.v / point_a.w) * alpha +
-                     (b_uv.v / point_b.w) * beta + (c_uv.v / point_c.w) * gamma;
-    interpolated_reciprocal_w = (1 / point_a.w) * alpha +
-                                (1 / point_b.w) * beta +
-                                (1 / point_c.w) * gamma;
-    // Perspective correct interpolation
-    interpolated_u /= interpolated_reciprocal_w;
-    interpolated_v /= interpolated_reciprocal_w;
-
-    // Get the mesh texture width and height dimensions
-    int texture_width = upng_get_width(texture);
-    int texture_height = upng_get_height(texture);
-
-    // Map the UV coordinate to the full texture width and height
-    // x and y are integers, maybe outside of the triangle in math,
-    // so use mod to prevent texture buffer overflow
-    int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-    int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
-
-    // Initial value in z-buffer is 1.0f, but
-    // w is original z which did not be normalized to [0,1],
-    // so we need to interpolate 1/z to do depth comparison,
-    // but why use 1/w here?
-
-    // Smaller w is, closer to screen the pixel is, greater 1/w is,
-    // adjust 1/w so the pixels that are closer to the camera have smaller
-    // values. Why use 1.0 here?
-    // (1.0 - positive number) is always less than 1.0 which is the initial
-    // value of z-buffer. But what if w is negetive number?
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
-
-    // Only draw the pixel if the depth value is less than the one
-    // previously stored in the z-buffer
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-        uint32_t *texture_buffer = (uint32_t *)upng_get_buffer(texture);
-        draw_pixel(x, y, texture_buffer[tex_y * texture_width + tex_x]);
-        // Update the z-buffer value with the 1/w of this current pixel
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+static FORCE_INLINE float max_abs(float a, float b) {
+    a = a < 0 ? -a : a;
+    b = b < 0 ? -b : b;
+    return a > b ? a : b;
+}
+
+static FORCE_INLINE void compute_setup_batch(setup_batch_t *batch, int shade,
+                                             int overlay) {
+    float dx1[SETUP_BATCH_SIZE], dy1[SETUP_BATCH_SIZE];
+    float dx2[SETUP_BATCH_SIZE], dy2[SETUP_BATCH_SIZE];
+    float inv_area[SETUP_BATCH_SIZE];
+    for (int i = 0; i < SETUP_BATCH_SIZE; i++) {
+        int edge_x1 = batch->x[1][i] - batch->x[0][i];
+        int edge_y1 = batch->y[1][i] - batch->y[0][i];
+        int edge_x2 = batch->x[2][i] - batch->x[0][i];
+        int edge_y2 = batch->y[2][i] - batch->y[0][i];
+        batch->area[i] = edge_x1 * edge_y2 - edge_x2 * edge_y1;
+        dx1[i] = edge_x1;
+        dy1[i] = edge_y1;
+        dx2[i] = edge_x2;
+        dy2[i] = edge_y2;
+        inv_area[i] = batch->area[i] != 0 ? 1.0f / batch->area[i] : 0.0f;
+    }
+    for (int i = 0; i < SETUP_BATCH_SIZE; i++) {
+        setup_gradient(batch->reciprocal_w[0][i], batch->reciprocal_w[1][i],
+                       batch->reciprocal_w[2][i], dx1[i], dy1[i], dx2[i],
+                       dy2[i], inv_area[i], &batch->reciprocal_w_dx[i],
+                       &batch->reciprocal_w_dy[i]);
+    }
+    if (shade == SHADE_TEXTURE) {
+        for (int i = 0; i < SETUP_BATCH_SIZE; i++) {
+            setup_gradient(batch->u_over_w[0][i], batch->u_over_w[1][i],
+                           batch->u_over_w[2][i], dx1[i], dy1[i], dx2[i],
+                           dy2[i], inv_area[i], &batch->u_over_w_dx[i],
+                           &batch->u_over_w_dy[i]);
+            setup_gradient(batch->v_over_w[0][i], batch->v_over_w[1][i],
+                           batch->v_over_w[2][i], dx1[i], dy1[i], dx2[i],
+                           dy2[i], inv_area[i], &batch->v_over_w_dx[i],
+                           &batch->v_over_w_dy[i]);
+        }
+    }
+    if (overlay != OVERLAY_NONE) {
+        // The barycentric weight of a vertex times the doubled area is the
+        // distance to the opposite edge times the edge length, dividing by
+        // the major axis length of the edge instead gives the distance along
+        // its minor axis
+        for (int i = 0; i < SETUP_BATCH_SIZE; i++) {
+            float area = batch->area[i] < 0 ? -batch->area[i] : batch->area[i];
+            float opposite_edge0 = max_abs(dx2[i] - dx1[i], dy2[i] - dy1[i]);
+            float opposite_edge1 = max_abs(dx2[i], dy2[i]);
+            float opposite_edge2 = max_abs(dx1[i], dy1[i]);
+            batch->edge_scale[0][i] =
+                opposite_edge0 > 0 ? area / opposite_edge0 : 0.0f;
+            batch->edge_scale[1][i] =
+                opposite_edge1 > 0 ? area / opposite_edge1 : 0.0f;
+            batch->edge_scale[2][i] =
+                opposite_edge2 > 0 ? area / opposite_edge2 : 0.0f;
+            for (int j = 0; j < 3; j++) {
+                setup_gradient(j == 0, j == 1, j == 2, dx1[i], dy1[i], dx2[i],
+                               dy2[i], inv_area[i], &batch->edge_dx[j][i],
+                               &batch->edge_dy[j][i]);
+                batch->edge_dx[j][i] *= batch->edge_scale[j][i];
+                batch->edge_dy[j][i] *= batch->edge_scale[j][i];
+            }
+        }
+    }
+}
+
+// Large triangles are walked in blocks of this size, aligned like the tiles
+// of the tiled render target layout
+#define RASTER_BLOCK_SHIFT 4
+#define RASTER_BLOCK_SIZE (1 << RASTER_BLOCK_SHIFT)
+#define RASTER_BLOCK_MASK (RASTER_BLOCK_SIZE - 1)
+
+// Rows before y1 belong to the flat-bottom half, rows from y1 on to the
+// flat-top half, first_row and last_row are clipped to the scissor rectangle.
+// Interlaced frames only rasterize every row_step-th row from first_row.
+typedef struct {
+    int x0, y0;
+    int x1, y1;
+    float bottom_slope;
+    float top_slope;
+    float long_slope;
+    int first_row;
+    int last_row;
+    int row_step;
+} triangle_rows_t;
+
+// First row at or after y that is rasterized
+static FORCE_INLINE int get_next_row(const triangle_rows_t *rows, int y) {
+    return rows->row_step == 1 ? y : y + ((y ^ rows->first_row) & 1);
+}
+
+static FORCE_INLINE void get_row_span(const triangle_rows_t *rows, int y,
+                                      int *x_start, int *x_end) {
+    float slope = y < rows->y1 ? rows->bottom_slope : rows->top_slope;
+    *x_start = rows->x1 + (y - rows->y1) * slope;
+    *x_end = rows->x0 + (y - rows->y0) * rows->long_slope;
+    if (*x_end < *x_start) {
+        int_swap(x_start, x_end);
+    }
+}
+
+// The edge distances are linear, so their minimum over a block is at one of
+// its corners, a pixel of margin covers the rounding of the stepped values
+static FORCE_INLINE bool is_block_away_from_edges(
+    const triangle_setup_t *setup, int block_x, int block_y) {
+    float dx = block_x - setup->x0;
+    float dy = block_y - setup->y0;
+    for (int i = 0; i < 3; i++) {
+        float corner = setup->edge[i] + setup->edge_dx[i] * dx +
+                       setup->edge_dy[i] * dy;
+        float step_x = setup->edge_dx[i] * RASTER_BLOCK_MASK;
+        float step_y = setup->edge_dy[i] * RASTER_BLOCK_MASK;
+        corner += (step_x < 0 ? step_x : 0) + (step_y < 0 ? step_y : 0);
+        if (corner < WIRE_WIDTH + 1.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Coarse to fine, blocks of a block row fully covered by its spans and away
+// from the edges form one run, since the covered part and every edge
+// half-plane are convex. Inside the run the wireframe test of every pixel is
+// skipped, only the pixels of the partially covered blocks are tested.
+static FORCE_INLINE void rasterize_blocks(const triangle_setup_t *setup,
+                                          const triangle_rows_t *rows,
+                                          const scissor_t *scissor,
+                                          int format, int shade, int depth,
+                                          int overlay, int wrap) {
+    int span_start[RASTER_BLOCK_SIZE];
+    int span_end[RASTER_BLOCK_SIZE];
+    for (int block_y = rows->first_row & ~RASTER_BLOCK_MASK;
+         block_y <= rows->last_row; block_y += RASTER_BLOCK_SIZE) {
+        int row_first =
+            block_y > rows->first_row ? block_y : rows->first_row;
+        int row_last = block_y + RASTER_BLOCK_MASK < rows->last_row
+                           ? block_y + RASTER_BLOCK_MASK
+                           : rows->last_row;
+        // Pixels covered by every row of the block row
+        int inner_start = scissor->min_x;
+        int inner_end = scissor->max_x - 1;
+        for (int y = row_first; y <= row_last; y++) {
+            int x_start, x_end;
+            get_row_span(rows, y, &x_start, &x_end);
+            span_start[y - block_y] = x_start;
+            span_end[y - block_y] = x_end;
+            inner_start = x_start > inner_start ? x_start : inner_start;
+            inner_end = x_end < inner_end ? x_end : inner_end;
+        }
+        int first_block = 1;
+        int last_block = 0;
+        if (row_first == block_y && row_last == block_y + RASTER_BLOCK_MASK &&
+            inner_start <= inner_end) {
+            first_block =
+                (inner_start + RASTER_BLOCK_MASK) >> RASTER_BLOCK_SHIFT;
+            last_block = ((inner_end + 1) >> RASTER_BLOCK_SHIFT) - 1;
+        }
+        while (first_block <= last_block &&
+               !is_block_away_from_edges(
+                   setup, first_block << RASTER_BLOCK_SHIFT, block_y)) {
+            first_block++;
+        }
+        while (last_block >= first_block &&
+               !is_block_away_from_edges(
+                   setup, last_block << RASTER_BLOCK_SHIFT, block_y)) {
+            last_block--;
+        }
+
+        for (int y = get_next_row(rows, row_first); y <= row_last;
+             y += rows->row_step) {
+            int x_start = span_start[y - block_y];
+            int x_end = span_end[y - block_y];
+            if (first_block > last_block) {
+                rasterize_span(setup, scissor, y, x_start, x_end, format,
+                               shade, depth, overlay, wrap);
+                continue;
+            }
+            int inner_x = first_block << RASTER_BLOCK_SHIFT;
+            int inner_x_end = (last_block << RASTER_BLOCK_SHIFT) +
+                              RASTER_BLOCK_MASK;
+            rasterize_span(setup, scissor, y, x_start, inner_x - 1, format,
+                           shade, depth, overlay, wrap);
+            rasterize_span(setup, scissor, y, inner_x, inner_x_end, format,
+                           shade, depth, OVERLAY_NONE, wrap);
+            rasterize_span(setup, scissor, y, inner_x_end + 1, x_end, format,
+                           shade, depth, overlay, wrap);
+        }
+    }
+}
+
+// Triangles spanning at most this many pixels in x and y take the small
+// triangle path
+#define SMALL_TRIANGLE_SIZE 8
+
+// Small triangles are bound by the overhead of every scanline, the depth of
+// the whole bounding box is prepared at once and every row is a single run.
+// Returns false if the bounding box is split across runs of a tiled layout.
+static FORCE_INLINE bool rasterize_small(const triangle_setup_t *setup,
+                                         const triangle_rows_t *rows,
+                                         const scissor_t *scissor, int min_x,
+                                         int max_x, int format, int shade,
+                                         int depth, int overlay, int wrap) {
+    min_x = min_x > scissor->min_x ? min_x : scissor->min_x;
+    max_x = max_x < scissor->max_x - 1 ? max_x : scissor->max_x - 1;
+    if (min_x > max_x || rows->first_row > rows->last_row) {
+        return true;
+    }
+    if (get_contiguous_end(min_x, max_x) != max_x) {
+        return false;
+    }
+    if (depth != DEPTH_TEST_OFF) {
+        prepare_zbuffer_rect(min_x, rows->first_row, max_x, rows->last_row);
+    }
+    for (int y = rows->first_row; y <= rows->last_row; y += rows->row_step) {
+        int x_start, x_end;
+        get_row_span(rows, y, &x_start, &x_end);
+        x_start = x_start > min_x ? x_start : min_x;
+        x_end = x_end < max_x ? x_end : max_x;
+        if (x_start > x_end) {
+            continue;
+        }
+        span_attributes_t attributes;
+        evaluate_attributes(setup, x_start, y, shade, overlay, &attributes);
+        void *depth_run =
+            depth != DEPTH_TEST_OFF ? get_zbuffer_pixel(x_start, y) : NULL;
+        rasterize_run(setup, get_color_pixel(x_start, y), depth_run, x_start,
+                      y, x_end - x_start + 1, &attributes, format, shade,
+                      depth, overlay, wrap);
+    }
+    return true;
+}
+
+// Texels a pixel step covers at most, coarse shading loses no detail when
+// every texel spans at least a 2x2 pixel block
+#define COARSE_SHADING_MAX_TEXELS 0.5f
+
+// Screen space derivatives of u and v at every vertex, the footprint of a
+// pixel in the texture is largest at one of them
+static FORCE_INLINE bool is_texture_magnified(const setup_batch_t *batch,
+                                              int lane,
+                                              const texture_t *texture) {
+    for (int i = 0; i < 3; i++) {
+        float w = 1.0f / batch->reciprocal_w[i][lane];
+        float u = batch->u_over_w[i][lane] * w;
+        float v = batch->v_over_w[i][lane] * w;
+        float du_dx = (batch->u_over_w_dx[lane] -
+                       u * batch->reciprocal_w_dx[lane]) * w;
+        float du_dy = (batch->u_over_w_dy[lane] -
+                       u * batch->reciprocal_w_dy[lane]) * w;
+        float dv_dx = (batch->v_over_w_dx[lane] -
+                       v * batch->reciprocal_w_dx[lane]) * w;
+        float dv_dy = (batch->v_over_w_dy[lane] -
+                       v * batch->reciprocal_w_dy[lane]) * w;
+        if (max_abs(du_dx, du_dy) * texture->width >
+                COARSE_SHADING_MAX_TEXELS ||
+            max_abs(dv_dx, dv_dy) * texture->height >
+                COARSE_SHADING_MAX_TEXELS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static FORCE_INLINE void init_triangle_setup(const setup_batch_t *batch,
+                                             int lane,
+                                             const triangle_t *triangle,
+                                             float depth_scale, int shade,
+                                             int overlay, bool variable_rate,
+                                             triangle_setup_t *setup) {
+    *setup = (triangle_setup_t){
+        .x0 = batch->x[0][lane],
+        .y0 = batch->y[0][lane],
+        .reciprocal_w = batch->reciprocal_w[0][lane],
+        .reciprocal_w_dx = batch->reciprocal_w_dx[lane],
+        .reciprocal_w_dy = batch->reciprocal_w_dy[lane],
+        .color = triangle->color,
+        .texture = triangle->texture,
+        .depth_scale = depth_scale};
+    if (shade == SHADE_TEXTURE) {
+        setup->u_over_w = batch->u_over_w[0][lane];
+        setup->u_over_w_dx = batch->u_over_w_dx[lane];
+        setup->u_over_w_dy = batch->u_over_w_dy[lane];
+        setup->v_over_w = batch->v_over_w[0][lane];
+        setup->v_over_w_dx = batch->v_over_w_dx[lane];
+        setup->v_over_w_dy = batch->v_over_w_dy[lane];
+        if (variable_rate && triangle->texture != NULL &&
+            is_texture_magnified(batch, lane, triangle->texture)) {
+            setup->coarse_shading = true;
+            setup->serial = next_serial++;
+        }
+    }
+    if (overlay != OVERLAY_NONE) {
+        // At the first vertex only its own weight is 1
+        for (int i = 0; i < 3; i++) {
+            setup->edge[i] = i == 0 ? batch->edge_scale[0][lane] : 0.0f;
+            setup->edge_dx[i] = batch->edge_dx[i][lane];
+            setup->edge_dy[i] = batch->edge_dy[i][lane];
+        }
     }
 }
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
-                            float v0, int x1, int y1, float z1, float w1,
-                            float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, upng_t *texture) {
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-        float_swap(&u1, &u2);
-        float_swap(&v1, &v2);
-    }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-
-    // Flip the V component to account for inverted UV-coordinates (V grows
-    // downwards), maybe in obj file, or in upng buffer
-    v0 = 1.0 - v0;
-    v1 = 1.0 - v1;
-    v2 = 1.0 - v2;
-
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
-    text2_t a_uv = {u0, v0};
-    text2_t b_uv = {u1, v1};
-    text2_t c_uv = {u2, v2};
-
-    // Flat bottom
-    float inv_slope1 = 0;
-    float inv_slope2 = 0;
+static FORCE_INLINE void init_triangle_rows(const setup_batch_t *batch,
+                                            int lane,
+                                            const scissor_t *scissor,
+                                            int field, triangle_rows_t *rows) {
+    int x0 = batch->x[0][lane], y0 = batch->y[0][lane];
+    int x1 = batch->x[1][lane], y1 = batch->y[1][lane];
+    int x2 = batch->x[2][lane], y2 = batch->y[2][lane];
+    *rows = (triangle_rows_t){.x0 = x0, .y0 = y0, .x1 = x1, .y1 = y1};
     if (y1 - y0 != 0) {
-        inv_slope1 = (float)(x1 - x0) / abs(y1 - y0);
+        rows->bottom_slope = (float)(x1 - x0) / abs(y1 - y0);
+    }
+    if (y2 - y1 != 0) {
+        rows->top_slope = (float)(x2 - x1) / abs(y2 - y1);
     }
     if (y2 - y0 != 0) {
-        inv_slope2 = (float)(x2 - x0) / abs(y2 - y0);
+        rows->long_slope = (float)(x2 - x0) / abs(y2 - y0);
     }
-    if (y1 - y0 != 0) {
-        for (int y = y0; y < y1; y++) {
-            int x_start = x1 + (y - y1) * inv_slope1;
-            int x_end = x0 + (y - y0) * inv_slope2;
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+    // Scanlines outside of the scissor rectangle are skipped as a whole, a
+    // triangle with a flat bottom ends before its bottom row
+    int last_row = y2 - y1 != 0 ? y2 : y1 - 1;
+    rows->first_row = y0 > scissor->min_y ? y0 : scissor->min_y;
+    rows->last_row =
+        last_row < scissor->max_y - 1 ? last_row : scissor->max_y - 1;
+    rows->row_step = 1;
+    if (field >= 0) {
+        rows->row_step = 2;
+        rows->first_row += (rows->first_row & 1) != field;
+    }
+}
+
+// Fill with flat-bottom and flat-top halves
+static FORCE_INLINE void rasterize_lane(const setup_batch_t *batch, int lane,
+                                        const triangle_t *triangle,
+                                        const scissor_t *scissor,
+                                        float depth_scale, bool variable_rate,
+                                        int field, int format, int shade,
+                                        int depth, int overlay, int wrap) {
+    if (batch->area[lane] == 0) {
+        return;
+    }
+    int x0 = batch->x[0][lane], y0 = batch->y[0][lane];
+    int x1 = batch->x[1][lane];
+    int x2 = batch->x[2][lane], y2 = batch->y[2][lane];
+    triangle_setup_t setup;
+    init_triangle_setup(batch, lane, triangle, depth_scale, shade, overlay,
+                        variable_rate, &setup);
+    triangle_rows_t rows;
+    init_triangle_rows(batch, lane, scissor, field, &rows);
+
+    int min_x = x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2);
+    int max_x = x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2);
+    if (max_x - min_x < SMALL_TRIANGLE_SIZE &&
+        y2 - y0 < SMALL_TRIANGLE_SIZE &&
+        rasterize_small(&setup, &rows, scissor, min_x, max_x, format, shade,
+                        depth, overlay, wrap)) {
+        return;
+    }
+    // Only the wireframe overlay has per-pixel work that whole blocks can
+    // skip, and only triangles spanning a few blocks have inner ones. Blocks
+    // restart the stepping of 1/w inside the spans, the equal tests need it
+    // stepped exactly like the depth pass did.
+    if (overlay != OVERLAY_NONE && depth != DEPTH_TEST_EQUAL &&
+        depth != DEPTH_TEST_EQUAL_UNORM16 &&
+        max_x - min_x >= 3 * RASTER_BLOCK_SIZE &&
+        y2 - y0 >= 3 * RASTER_BLOCK_SIZE) {
+        rasterize_blocks(&setup, &rows, scissor, format, shade, depth,
+                         overlay, wrap);
+        return;
+    }
+    for (int y = rows.first_row; y <= rows.last_row; y += rows.row_step) {
+        int x_start, x_end;
+        get_row_span(&rows, y, &x_start, &x_end);
+        rasterize_span(&setup, scissor, y, x_start, x_end, format, shade,
+                       depth, overlay, wrap);
+    }
+}
+
+static FORCE_INLINE void rasterize_triangles(const triangle_t *triangles,
+                                             int count, int format, int shade,
+                                             int depth, int overlay,
+                                             int wrap) {
+    scissor_t scissor = get_scissor();
+    float depth_scale = 65535.0f * get_depth_near();
+    bool variable_rate = is_variable_rate_shading();
+    int field = get_interlaced_field();
+    setup_batch_t batch;
+    for (int first = 0; first < count; first += SETUP_BATCH_SIZE) {
+        int batch_count = count - first < SETUP_BATCH_SIZE
+                              ? count - first
+                              : SETUP_BATCH_SIZE;
+        load_setup_batch(&batch, triangles + first, batch_count, shade);
+        compute_setup_batch(&batch, shade, overlay);
+        for (int lane = 0; lane < batch_count; lane++) {
+            // Filled triangles draw their wireframe in the fill pass
+            rasterize_lane(&batch, lane, &triangles[first + lane], &scissor,
+                           depth_scale, variable_rate, field, format, shade,
+                           depth, overlay, wrap);
+        }
+    }
+}
+
+typedef void (*triangle_batch_t)(const triangle_t *triangles, int count);
+
+#define DEFINE_TRIANGLE_BATCH(name, format, shade, depth, overlay, wrap)      \
+    static void name(const triangle_t *triangles, int count) {                 \
+        rasterize_triangles(triangles, count, format, shade, depth, overlay,   \
+                            wrap);                                             \
+    }
+
+#define DEFINE_FILL_BATCHES(format, depth)                                     \
+    DEFINE_TRIANGLE_BATCH(fill_batch_##format##_##depth, format, SHADE_FILL,   \
+                          depth, OVERLAY_NONE, WRAP_REPEAT)                    \
+    DEFINE_TRIANGLE_BATCH(fill_wire_batch_##format##_##depth, format,          \
+                          SHADE_FILL, depth, OVERLAY_WIRE, WRAP_REPEAT)
+
+#define DEFINE_TEXTURE_BATCHES(format, depth, wrap)                            \
+    DEFINE_TRIANGLE_BATCH(texture_batch_##format##_##depth##_##wrap, format,   \
+                          SHADE_TEXTURE, depth, OVERLAY_NONE, wrap)            \
+    DEFINE_TRIANGLE_BATCH(texture_wire_batch_##format##_##depth##_##wrap,      \
+                          format, SHADE_TEXTURE, depth, OVERLAY_WIRE, wrap)
+
+#define DEFINE_DEPTH_BATCHES(format, depth)                                    \
+    DEFINE_FILL_BATCHES(format, depth)                                         \
+    DEFINE_TEXTURE_BATCHES(format, depth, WRAP_REPEAT)                         \
+    DEFINE_TEXTURE_BATCHES(format, depth, WRAP_REPEAT_POW2)                    \
+    DEFINE_TEXTURE_BATCHES(format, depth, WRAP_CLAMP)
+
+#define DEFINE_FORMAT_BATCHES(format)                                          \
+    DEFINE_DEPTH_BATCHES(format, DEPTH_TEST_OFF)                               \
+    DEFINE_DEPTH_BATCHES(format, DEPTH_TEST_LESS)                              \
+    DEFINE_DEPTH_BATCHES(format, DEPTH_TEST_LESS_UNORM16)                      \
+    DEFINE_DEPTH_BATCHES(format, DEPTH_TEST_EQUAL)                             \
+    DEFINE_DEPTH_BATCHES(format, DEPTH_TEST_EQUAL_UNORM16)
+
+DEFINE_FORMAT_BATCHES(COLOR_FORMAT_RGBA8888)
+DEFINE_FORMAT_BATCHES(COLOR_FORMAT_RGB565)
+
+// Depth pass kernels, no color is written so the format does not matter
+DEFINE_TRIANGLE_BATCH(depth_batch_DEPTH_TEST_LESS, COLOR_FORMAT_RGBA8888,
+                      SHADE_DEPTH_ONLY, DEPTH_TEST_LESS, OVERLAY_NONE,
+                      WRAP_REPEAT)
+DEFINE_TRIANGLE_BATCH(depth_batch_DEPTH_TEST_LESS_UNORM16,
+                      COLOR_FORMAT_RGBA8888, SHADE_DEPTH_ONLY,
+                      DEPTH_TEST_LESS_UNORM16, OVERLAY_NONE, WRAP_REPEAT)
+
+// Indexed by [depth format]
+static const triangle_batch_t depth_batches[2] = {
+    depth_batch_DEPTH_TEST_LESS,
+    depth_batch_DEPTH_TEST_LESS_UNORM16,
+};
+
+#define FILL_BATCHES(format, depth)                                            \
+    {fill_batch_##format##_##depth, fill_wire_batch_##format##_##depth}
+
+#define FILL_FORMAT_BATCHES(format)                                            \
+    {FILL_BATCHES(format, DEPTH_TEST_OFF),                                     \
+     FILL_BATCHES(format, DEPTH_TEST_LESS),                                    \
+     FILL_BATCHES(format, DEPTH_TEST_LESS_UNORM16),                            \
+     FILL_BATCHES(format, DEPTH_TEST_EQUAL),                                   \
+     FILL_BATCHES(format, DEPTH_TEST_EQUAL_UNORM16)}
+
+// Indexed by [color format][depth][wire overlay]
+static const triangle_batch_t fill_batches[2][5][2] = {
+    FILL_FORMAT_BATCHES(COLOR_FORMAT_RGBA8888),
+    FILL_FORMAT_BATCHES(COLOR_FORMAT_RGB565),
+};
+
+#define TEXTURE_WRAP_BATCHES(name)                                             \
+    {name##_WRAP_REPEAT, name##_WRAP_REPEAT_POW2, name##_WRAP_CLAMP}
+
+#define TEXTURE_BATCHES(format, depth)                                         \
+    {TEXTURE_WRAP_BATCHES(texture_batch_##format##_##depth),                   \
+     TEXTURE_WRAP_BATCHES(texture_wire_batch_##format##_##depth)}
+
+#define TEXTURE_FORMAT_BATCHES(format)                                         \
+    {TEXTURE_BATCHES(format, DEPTH_TEST_OFF),                                  \
+     TEXTURE_BATCHES(format, DEPTH_TEST_LESS),                                 \
+     TEXTURE_BATCHES(format, DEPTH_TEST_LESS_UNORM16),                         \
+     TEXTURE_BATCHES(format, DEPTH_TEST_EQUAL),                                \
+     TEXTURE_BATCHES(format, DEPTH_TEST_EQUAL_UNORM16)}
+
+// Indexed by [color format][depth][wire overlay][wrap]
+static const triangle_batch_t texture_batches[2][5][2][3] = {
+    TEXTURE_FORMAT_BATCHES(COLOR_FORMAT_RGBA8888),
+    TEXTURE_FORMAT_BATCHES(COLOR_FORMAT_RGB565),
+};
+
+static int texture_wrap_variant(const texture_t *texture) {
+    if (texture->wrap_mode == TEXTURE_WRAP_CLAMP) {
+        return WRAP_CLAMP;
+    }
+    return is_texture_power_of_two(texture) ? WRAP_REPEAT_POW2 : WRAP_REPEAT;
+}
+
+typedef void (*span_shader_t)(const triangle_setup_t *setup,
+                              const scissor_t *scissor, int y, int x_start,
+                              int x_end);
+
+// Visible spans are shaded once, so they need no depth test
+#define DEFINE_SPAN_SHADER(name, format, shade, overlay, wrap)                 \
+    static void name(const triangle_setup_t *setup, const scissor_t *scissor,  \
+                     int y, int x_start, int x_end) {                          \
+        rasterize_span(setup, scissor, y, x_start, x_end, format, shade,       \
+                       DEPTH_TEST_OFF, overlay, wrap);                         \
+    }
+
+#define DEFINE_TEXTURE_SPAN_SHADERS(format, wrap)                              \
+    DEFINE_SPAN_SHADER(texture_span_##format##_##wrap, format, SHADE_TEXTURE,  \
+                       OVERLAY_NONE, wrap)                                     \
+    DEFINE_SPAN_SHADER(texture_wire_span_##format##_##wrap, format,            \
+                       SHADE_TEXTURE, OVERLAY_WIRE, wrap)
+
+#define DEFINE_FORMAT_SPAN_SHADERS(format)                                     \
+    DEFINE_SPAN_SHADER(fill_span_##format, format, SHADE_FILL, OVERLAY_NONE,   \
+                       WRAP_REPEAT)                                            \
+    DEFINE_SPAN_SHADER(fill_wire_span_##format, format, SHADE_FILL,            \
+                       OVERLAY_WIRE, WRAP_REPEAT)                              \
+    DEFINE_TEXTURE_SPAN_SHADERS(format, WRAP_REPEAT)                           \
+    DEFINE_TEXTURE_SPAN_SHADERS(format, WRAP_REPEAT_POW2)                      \
+    DEFINE_TEXTURE_SPAN_SHADERS(format, WRAP_CLAMP)
+
+DEFINE_FORMAT_SPAN_SHADERS(COLOR_FORMAT_RGBA8888)
+DEFINE_FORMAT_SPAN_SHADERS(COLOR_FORMAT_RGB565)
+
+// Indexed by [color format][wire overlay]
+static const span_shader_t fill_span_shaders[2][2] = {
+    {fill_span_COLOR_FORMAT_RGBA8888, fill_wire_span_COLOR_FORMAT_RGBA8888},
+    {fill_span_COLOR_FORMAT_RGB565, fill_wire_span_COLOR_FORMAT_RGB565},
+};
+
+#define TEXTURE_SPAN_SHADERS(format)                                           \
+    {TEXTURE_WRAP_BATCHES(texture_span_##format),                              \
+     TEXTURE_WRAP_BATCHES(texture_wire_span_##format)}
+
+// Indexed by [color format][wire overlay][wrap]
+static const span_shader_t texture_span_shaders[2][2][3] = {
+    TEXTURE_SPAN_SHADERS(COLOR_FORMAT_RGBA8888),
+    TEXTURE_SPAN_SHADERS(COLOR_FORMAT_RGB565),
+};
+
+// Setup and shader of every triangle of the queue, indexed by the span ids
+static triangle_setup_t *span_setups = NULL;
+static span_shader_t *span_shaders = NULL;
+static int max_span_triangles = 0;
+
+// All triangles are resolved into the span buffer first, then every visible
+// span is shaded once, whatever the overdraw. No depth buffer is involved.
+static void draw_span_buffer(const triangle_t *triangles, int count,
+                             const render_state_t *state) {
+    if (count > max_span_triangles) {
+        span_setups = (triangle_setup_t *)realloc(
+            span_setups, sizeof(triangle_setup_t) * count);
+        span_shaders = (span_shader_t *)realloc(
+            span_shaders, sizeof(span_shader_t) * count);
+        max_span_triangles = count;
+    }
+    int format = state->color_format;
+    int wire = state->wireframe;
+    int shade = state->textured ? SHADE_TEXTURE : SHADE_FILL;
+    int overlay = wire ? OVERLAY_WIRE : OVERLAY_NONE;
+    scissor_t scissor = get_scissor();
+    clear_span_buffer(get_window_height());
+
+    setup_batch_t batch;
+    for (int first = 0; first < count; first += SETUP_BATCH_SIZE) {
+        int batch_count = count - first < SETUP_BATCH_SIZE
+                              ? count - first
+                              : SETUP_BATCH_SIZE;
+        load_setup_batch(&batch, triangles + first, batch_count, shade);
+        compute_setup_batch(&batch, shade, overlay);
+        for (int lane = 0; lane < batch_count; lane++) {
+            if (batch.area[lane] == 0) {
+                continue;
             }
-            for (int x = x_start; x <= x_end; x++) {
-                draw_triangle_texel(x, y, texture, point_a, point_b, point_c,
-                                    a_uv, b_uv, c_uv);
+            int index = first + lane;
+            const texture_t *texture = triangles[index].texture;
+            triangle_setup_t *setup = &span_setups[index];
+            init_triangle_setup(&batch, lane, &triangles[index], 0.0f, shade,
+                                overlay, state->variable_rate_shading, setup);
+            span_shaders[index] =
+                shade == SHADE_TEXTURE && texture != NULL
+                    ? texture_span_shaders[format][wire]
+                                          [texture_wrap_variant(texture)]
+                    : fill_span_shaders[format][wire];
+
+            triangle_rows_t rows;
+            init_triangle_rows(&batch, lane, &scissor, get_interlaced_field(),
+                               &rows);
+            for (int y = rows.first_row; y <= rows.last_row;
+                 y += rows.row_step) {
+                int x_start, x_end;
+                get_row_span(&rows, y, &x_start, &x_end);
+                x_start = x_start > scissor.min_x ? x_start : scissor.min_x;
+                x_end = x_end < scissor.max_x - 1 ? x_end : scissor.max_x - 1;
+                if (x_start > x_end) {
+                    continue;
+                }
+                // The 1/w plane along the row, relative to its pixel 0
+                float depth = setup->reciprocal_w -
+                              setup->reciprocal_w_dx * setup->x0 +
+                              setup->reciprocal_w_dy * (y - setup->y0);
+                insert_span(y, x_start, x_end, depth, setup->reciprocal_w_dx,
+                            index);
             }
         }
     }
 
-    // Flat top
-    inv_slope1 = 0;
-    inv_slope2 = 0;
-    if (y2 - y1 != 0) {
-        inv_slope1 = (float)(x2 - x1) / abs(y2 - y1);
+    const span_t *spans = get_spans();
+    for (int y = scissor.min_y; y < scissor.max_y; y++) {
+        for (int i = get_first_span(y); i >= 0; i = spans[i].next) {
+            int id = spans[i].id;
+            span_shaders[id](&span_setups[id], &scissor, y, spans[i].x_start,
+                             spans[i].x_end);
+        }
     }
-    if (y2 - y0 != 0) {
-        inv_slope2 = (float)(x2 - x0) / abs(y2 - y0);
+}
+
+// Every block of the cache is stale at the start of a queue
+static void reset_coarse_shading(void) {
+    int num_blocks = (get_window_width() + 1) / 2;
+    if (num_blocks > max_coarse_blocks) {
+        coarse_colors = (uint32_t *)realloc(coarse_colors,
+                                            sizeof(uint32_t) * num_blocks);
+        coarse_keys =
+            (uint64_t *)realloc(coarse_keys, sizeof(uint64_t) * num_blocks);
+        max_coarse_blocks = num_blocks;
     }
-    if (y2 - y1 != 0) {
-        for (int y = y1; y <= y2; y++) {
-            int x_start = x1 + (y - y1) * inv_slope1;
-            int x_end = x0 + (y - y0) * inv_slope2;
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+    memset(coarse_keys, 0xFF, sizeof(uint64_t) * num_blocks);
+    next_serial = 0;
+}
+
+void free_triangle_buffers(void) {
+    free(coarse_colors);
+    free(coarse_keys);
+    coarse_colors = NULL;
+    coarse_keys = NULL;
+    max_coarse_blocks = 0;
+    free(span_setups);
+    free(span_shaders);
+    span_setups = NULL;
+    span_shaders = NULL;
+    max_span_triangles = 0;
+    free_span_buffer();
+}
+
+void draw_triangles(const triangle_t *triangles, int count,
+                    const render_state_t *state) {
+    int format = state->color_format;
+    int depth = DEPTH_TEST_OFF;
+    if (state->depth_test) {
+        depth = state->depth_format == DEPTH_FORMAT_UNORM16
+                    ? DEPTH_TEST_LESS_UNORM16
+                    : DEPTH_TEST_LESS;
+    }
+    int wire = state->wireframe;
+    if (state->textured && state->variable_rate_shading) {
+        reset_coarse_shading();
+    }
+    if (state->visibility == VISIBILITY_SPAN_BUFFER && state->depth_test) {
+        draw_span_buffer(triangles, count, state);
+        return;
+    }
+    if (state->visibility == VISIBILITY_DEPTH_PREPASS && state->depth_test) {
+        // Only the closest depth is left after the depth pass, the shading
+        // pass then shades every pixel once at most
+        depth_batches[state->depth_format](triangles, count);
+        depth = depth == DEPTH_TEST_LESS_UNORM16 ? DEPTH_TEST_EQUAL_UNORM16
+                                                 : DEPTH_TEST_EQUAL;
+    }
+
+    if (state->textured) {
+        // The queue is sorted by texture, so the variant depending on the
+        // texture is chosen once for every run of triangles sharing it
+        int start = 0;
+        while (start < count) {
+            const texture_t *texture = triangles[start].texture;
+            int end = start + 1;
+            while (end < count && triangles[end].texture == texture) {
+                end++;
             }
-            for (int x = x_start; x <= x_end; x++) {
-                draw_triangle_texel(x, y, texture, point_a, point_b, point_c,
-                                    a_uv, b_uv, c_uv);
+            if (texture != NULL) {
+                texture_batches[format][depth][wire]
+                               [texture_wrap_variant(texture)](
+                    triangles + start, end - start);
+            } else {
+                fill_batches[format][depth][wire](triangles + start,
+                                                  end - start);
             }
+            start = end;
         }
+    } else if (state->filled) {
+        fill_batches[format][depth][wire](triangles, count);
     }
 }